@@ -104,6 +104,13 @@ static inline void bs_flush( bs_t *s )
     s->p += WORD_SIZE - (s->i_left >> 3);
     s->i_left = WORD_SIZE*8;
 }
+/* bs_flush for byte-aligned writers: leaves the buffer untouched if there are no pending bits,
+ * so that whole bytes can be stored at s->p without running past the end of the data. */
+static inline void bs_flush_bytes( bs_t *s )
+{
+    if( s->i_left != WORD_SIZE*8 )
+        bs_flush( s );
+}
 /* The inverse of bs_flush: prepare the bitstream to be written to again. */
 static inline void bs_realign( bs_t *s )
 {
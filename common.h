@@ -21,6 +21,7 @@
 #ifndef LIBMPEGTS_COMMON_H
 #define LIBMPEGTS_COMMON_H
 
+#include "config.h"
 #include <stdio.h>
 #include <stdlib.h>
 #if HAVE_STDINT_H
@@ -31,6 +32,10 @@
 #include "bitstream.h"
 #include "libmpegts.h"
 #include <string.h>
+#include <time.h>
+#if HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 /* Standardised Audio/Video stream_types */
 #define VIDEO_MPEG2       0x02
@@ -49,10 +54,29 @@
 #define TS_CLOCK       27000000LL
 #define TS_START       0
 
+/* Profiled phases of the mux */
+enum profile_phase_e
+{
+    PROFILE_PES,
+    PROFILE_SCHEDULE,
+    PROFILE_ADAPT_FIELD,
+    PROFILE_PSI,
+    PROFILE_TSTD,
+    PROFILE_PAYLOAD,
+    PROFILE_OUTPUT,
+    PROFILE_NULL_RUN,
+    PROFILE_COUNT
+};
+
+/* PES header including Teletext stuffing */
+#define PES_HEADER_MAX_SIZE 64
+
 // arbitrary
 #define MAX_PROGRAMS   100
 #define MAX_STREAMS    100
 
+#define MAX_PIDS       8192
+
 /* DVB 40ms recommendation */
 #define PCR_MAX_RETRANS_TIME 40
 #define PAT_MAX_RETRANS_TIME 100
@@ -146,14 +170,37 @@ typedef struct
 {
     int buf_size; /* size of buffer */
     int cur_buf;  /* current buffer fill */
+    int max_buf;  /* highest fill */
 
-    double last_byte_removal_time;
+    /* time of the last byte removal: 27MHz ticks plus a remainder in units of 1/rx ticks */
+    int64_t last_byte_removal_time;
+    int64_t last_byte_removal_rem;
 } buffer_t;
 
+/* PSI/SI section serialised into a ready-to-send packet */
+typedef struct
+{
+    int size; /* zero if the table needs to be rebuilt */
+    uint8_t data[TS_PACKET_SIZE+4]; /* including any tp_extra_header */
+} packet_cache_t;
+
+typedef struct ts_int_pes_t ts_int_pes_t;
+typedef struct ts_int_program_t ts_int_program_t;
+
+/* PES header with zero timestamps, patched for each frame */
+typedef struct
+{
+    int size; /* zero if the header needs to be built */
+    int length_pos; /* position of PES_packet_length, zero if it is not set */
+    int pts_pos;    /* the DTS follows the PTS */
+    uint8_t data[PES_HEADER_MAX_SIZE];
+} pes_header_t;
+
 typedef struct
 {
     int pid;
     int cc;
+    ts_int_program_t *program; /* program the stream belongs to */
     int stream_format; /* internal stream format type */
     int stream_type;   /* stream_type syntax element */
     int stream_id;
@@ -164,6 +211,7 @@ typedef struct
     mpegvideo_stream_ctx_t  *mpegvideo_ctx;
     lpcm_stream_ctx_t       *lpcm_ctx;
     ts_atsc_ac3_info        *atsc_ac3_ctx;
+    int                     ac3_probed;
     
     int                     num_dvb_sub;
     ts_dvb_sub_t            *dvb_sub_ctx;
@@ -173,6 +221,7 @@ typedef struct
 
     int num_channels;
     int max_frame_size;
+    int64_t max_delay; /* from arrival to the end of a pes in 27MHz ticks, 0 for no limit */
 
     /* T_STD */
     buffer_t tb; /* transport buffer */
@@ -181,6 +230,20 @@ typedef struct
     buffer_t eb; /* elementary buffer */
     int rbx;     /* flow from multiplex to elementary buffer (video) */
 
+    /* buffered PES in dts order */
+    ts_int_pes_t *pes_head;
+    ts_int_pes_t *pes_tail;
+    int heap_pos; /* position in the program's pes_heap */
+
+    /* pes header templates: PTS only and PTS with DTS */
+    pes_header_t pes_header[2];
+
+    /* written pes kept for reuse */
+    ts_int_pes_t *pes_pool;
+    int pes_buf_size; /* size of the data buffers allocated for this stream */
+    int64_t pool_allocs;
+    int64_t pool_reuses;
+
     /* Language Codes */
     int write_lang_code;
     char lang_code[4];
@@ -211,11 +274,12 @@ typedef struct
     int hdmv_aspect_ratio;
 } ts_int_stream_t;
 
-typedef struct
+struct ts_int_pes_t
 {
-    uint8_t *data;
-    int size;
-    uint8_t *cur_pos;
+    uint8_t *data;     /* PES header (followed by the payload unless in zero-copy mode) */
+    int data_size;     /* allocated size of data */
+    uint8_t *payload;  /* elementary stream data */
+    int size;          /* header and payload */
     int bytes_left;
     int handover_bytes_left;
 
@@ -226,6 +290,9 @@ typedef struct
     int random_access;
     int priority;
 
+    /* adaptation field of the first packet without a PCR, zero if there is none. Planned when the pes is built */
+    int start_af_size;
+
     int64_t dts;
     int64_t pts;
 
@@ -234,28 +301,55 @@ typedef struct
     int ref_pic_idc;
     int write_pulldown_info;
     int pic_struct;
-} ts_int_pes_t;
 
+    /* AC-3 info probed from the frame, moved to the stream when the pes is queued */
+    ts_atsc_ac3_info *ac3_info;
+
+    /* scheduling */
+    ts_int_pes_t *next; /* next pes of the same stream (or in the pool) */
+    int64_t seq;        /* order in which the pes was queued */
+    int64_t write_idx;  /* call of ts_write_frames during which the pes is written */
+};
+
+/* Lock-free single producer single consumer queue of pes */
 typedef struct
+{
+    ts_int_pes_t **pes;
+    int64_t mask;
+    int64_t head; /* next entry to take, only written by the consumer */
+    int64_t tail; /* next entry to add, only written by the producer */
+} ts_pes_ring_t;
+
+struct ts_int_program_t
 {
     ts_int_stream_t pmt;
+    packet_cache_t pmt_cache;
     int program_num;
 
     int num_streams;
     ts_int_stream_t *streams[MAX_STREAMS];
     ts_int_stream_t *pcr_stream;
 
-    double cur_pcr;
     uint64_t last_pcr;
+    /* pcr statistics */
+    int64_t num_pcrs;
+    uint64_t prev_pcr;
+    int64_t min_pcr_interval;
+    int64_t max_pcr_interval;
 
     int64_t video_dts;
 
+    /* non-video streams with pes ready to be written, min-heap on earliest arrival time */
+    int num_pes_heap;
+    ts_int_stream_t *pes_heap[MAX_STREAMS];
+    ts_int_stream_t *video_stream;
+
     //sdt_program_ctx_t *sdt_ctx;
     int cablelabs_is_3d;
 
     int sb_leak_rate;
     int sb_size;
-} ts_int_program_t;
+};
 
 struct ts_writer_t
 {
@@ -264,8 +358,57 @@ struct ts_writer_t
         int         i_bitstream;
         uint8_t     *p_bitstream;
         bs_t        bs;
+        int         user_buffer; /* p_bitstream belongs to the caller */
+        int         reserve;     /* room needed for one pass of the mux loop */
+
+        /* streaming output */
+        int         (*write_packets)( void *opaque, uint8_t *data, int len );
+        void        *write_opaque;
+        int         chunk_packets;
+        int         unsent;        /* bytes at the start of p_bitstream which the callback did not take */
+
+        /* null packet deletion */
+        int         null_deletion;
+        int         deleted_nulls; /* since the last packet written */
     } out;
 
+    /* real-time pacing of the output callback */
+    struct
+    {
+        int         enabled;
+        int         spin_ns;
+        int64_t     anchor_time; /* CLOCK_MONOTONIC time of anchor_pcr in ns */
+        int64_t     anchor_pcr;
+        int64_t     last_release;
+        int64_t     last_nominal;
+
+        int64_t     num_bursts;
+        int64_t     sum_offset;
+        int64_t     max_offset;
+        int64_t     max_jitter;
+    } pacing;
+
+    /* diagnostics, each event is reported at most once per interval of mux time */
+    struct
+    {
+        void        (*callback)( void *opaque, ts_diag_t *diag );
+        void        *opaque;
+        int64_t     interval;
+        int64_t     total[LIBMPEGTS_DIAG_COUNT];
+        int64_t     pending[LIBMPEGTS_DIAG_COUNT]; /* events since the last report */
+        int64_t     last_report[LIBMPEGTS_DIAG_COUNT];
+    } diag;
+
+#if HAVE_PROFILE
+    struct
+    {
+        int64_t     calls;
+        int64_t     ticks;
+    } profile[PROFILE_COUNT];
+    int             profile_phase; /* innermost phase being measured, -1 if none */
+    int64_t         profile_since; /* ticks when it was last started or resumed */
+#endif
+
     uint64_t bytes_written;
 
     int ts_type;
@@ -273,12 +416,22 @@ struct ts_writer_t
 
     int cbr;
     int ts_muxrate;
+    int scheduler;
+
+    /* current time, shared by all programs: 27MHz ticks plus a remainder in units of 1/ts_muxrate ticks */
+    int64_t cur_pcr;
+    int64_t cur_pcr_rem;
 
     int pat_cc;
+    packet_cache_t pat_cache;
+    packet_cache_t null_cache;
 
     int num_programs;
     ts_int_program_t *programs[MAX_PROGRAMS];
 
+    /* elementary stream carried on each PID */
+    ts_int_stream_t *pid_map[MAX_PIDS];
+
     int pat_period;
     int pcr_period;
     int first_input;
@@ -287,7 +440,51 @@ struct ts_writer_t
     int network_id;
 
     int num_buffered_frames;
-    ts_int_pes_t **buffered_frames;
+    int64_t pes_seq;
+    int64_t write_idx;
+
+    /* state of a call to ts_write_frames which ran out of output space */
+    int num_cur_pes;
+    int new_frames;
+
+    /* pes pool statistics of deleted streams */
+    int64_t pool_allocs;
+    int64_t pool_reuses;
+
+    /* packet statistics */
+    int64_t pid_packets[MAX_PIDS];
+    int64_t psi_packets;
+    int64_t pcr_packets;
+    int64_t deleted_packets; /* null packets counted in pid_packets but left out of the output */
+
+    /* pes built from the frames of the current call, in frame order */
+    ts_int_pes_t **frame_pes;
+    int max_frame_pes;
+
+    /* pipelined packetization: ts_queue_frames passes built pes to ts_write_frames through ready_pes
+     * and gets the written pes back for its pools through done_pes */
+    int pipeline;
+    ts_pes_ring_t ready_pes;
+    ts_pes_ring_t done_pes;
+
+#if HAVE_PTHREAD
+    /* packetization threads, each job builds the pes of one program */
+    int num_threads;
+    pthread_t *threads;
+    pthread_mutex_t thread_mutex;
+    pthread_cond_t job_cond;  /* new jobs or exit */
+    pthread_cond_t done_cond; /* all jobs finished */
+    int thread_exit;
+    int64_t job_id;
+    int next_job;
+    int jobs_left;
+    ts_frame_t *job_frames;
+    int num_job_frames;
+#endif
+
+    /* zero-copy */
+    void (*release_frame)( void *opaque, uint8_t *data );
+    void *release_opaque;
 
     /* system control */
     buffer_t tb;     /* transport buffer */
@@ -331,5 +528,54 @@ void write_crc( bs_t *s, int start );
 int write_padding( bs_t *s, int start );
 void increase_pcr( ts_writer_t *w, int num_packets );
 ts_int_stream_t *find_stream( ts_writer_t *w, int pid );
+void invalidate_pmt( ts_writer_t *w, ts_int_stream_t *stream );
+
+static inline int64_t monotonic_time( void )
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Profiling, compiled in with --enable-profile.
+ * PROFILE_START and PROFILE_STOP must be used in pairs in the same block. A phase started within another pauses
+ * it, so each phase only gets its own time. The pes phase can run on the packetization threads while packets
+ * are written, so it is measured on its own with PROFILE_START_ALONE and PROFILE_STOP_ALONE and cannot contain
+ * other phases */
+#if HAVE_PROFILE
+static inline int64_t profile_ticks( void )
+{
+#if ARCH_X86 || ARCH_X86_64
+    return __builtin_ia32_rdtsc();
+#else
+    return monotonic_time();
+#endif
+}
+
+/* Charge the time so far to the phase being measured and switch to another. Returns the previous phase */
+static inline int profile_switch( ts_writer_t *w, int phase )
+{
+    int64_t now = profile_ticks();
+    int prev = w->profile_phase;
+
+    if( prev >= 0 )
+        w->profile[prev].ticks += now - w->profile_since;
+    w->profile_phase = phase;
+    w->profile_since = now;
+
+    return prev;
+}
+
+#define PROFILE_START( w, phase ) int profile_##phase = profile_switch( w, phase )
+#define PROFILE_STOP( w, phase ) do { profile_switch( w, profile_##phase ); (w)->profile[phase].calls++; } while( 0 )
+#define PROFILE_START_ALONE( phase ) int64_t profile_##phase = profile_ticks()
+#define PROFILE_STOP_ALONE( w, phase ) do { (w)->profile[phase].ticks += profile_ticks() - profile_##phase; \
+                                            (w)->profile[phase].calls++; } while( 0 )
+#else
+#define PROFILE_START( w, phase )
+#define PROFILE_STOP( w, phase )
+#define PROFILE_START_ALONE( phase )
+#define PROFILE_STOP_ALONE( w, phase )
+#endif
 
 #endif
@@ -0,0 +1,11 @@
+#define HAVE_MALLOC_H 1
+#define ARCH_X86_64 1
+#define SYS_LINUX 1
+#define fseek fseeko
+#define ftell ftello
+#define HAVE_PTHREAD 1
+#define HAVE_CLOCK_NANOSLEEP 1
+#define HAVE_SOCKET 1
+#define HAVE_SENDMMSG 1
+#define LIBMPEGTS_VERSION " r0+43M 53c1cdb"
+#define LIBMPEGTS_POINTVER "0.0.0+43M 53c1cdb"
@@ -19,6 +19,12 @@
  *****************************************************************************/
 
 #include "../common.h"
+#include "crc.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_PCLMUL 1
+#include <wmmintrin.h>
+#endif
 
 static const uint32_t crc_table[256] =
 {
@@ -88,14 +94,147 @@ static const uint32_t crc_table[256] =
     0xBCB4666D, 0xB8757BDA, 0xB5365D03, 0xB1F740B4
 };
 
+/* crc_slice_table[k][i] is the CRC of byte i followed by k zero bytes */
+static uint32_t crc_slice_table[8][256];
+
+static uint32_t crc_32_c( uint8_t *bytes, int length );
+static uint32_t (*crc_32_func)( uint8_t *bytes, int length ) = crc_32_c;
+
+static uint32_t crc_update( uint32_t crc, uint8_t *bytes, int length )
+{
+    for( int i = 0; i < length; i++ )
+    {
+        int idx = ((crc >> 24) ^ bytes[i]) & 0xff;
+        crc = crc_table[idx] ^ (crc << 8);
+    }
+    return crc;
+}
+
+/* Slicing-by-8: eight bytes per iteration using one lookup per byte */
+static uint32_t crc_update_slice8( uint32_t crc, uint8_t *bytes, int length )
+{
+    uint32_t (*t)[256] = crc_slice_table;
+
+    for( ; length >= 8; bytes += 8, length -= 8 )
+    {
+        crc ^= ((uint32_t)bytes[0] << 24) | (bytes[1] << 16) | (bytes[2] << 8) | bytes[3];
+        crc = t[7][crc >> 24] ^ t[6][(crc >> 16) & 0xff] ^ t[5][(crc >> 8) & 0xff] ^ t[4][crc & 0xff] ^
+              t[3][bytes[4]] ^ t[2][bytes[5]] ^ t[1][bytes[6]] ^ t[0][bytes[7]];
+    }
+
+    return crc_update( crc, bytes, length );
+}
+
+static uint32_t crc_32_table( uint8_t *bytes, int length )
+{
+    return crc_update( 0xffffffff, bytes, length );
+}
+
+static uint32_t crc_32_c( uint8_t *bytes, int length )
+{
+    return crc_update_slice8( 0xffffffff, bytes, length );
+}
+
+#if HAVE_PCLMUL
+/* Fold constants x^(n+64) mod P and x^n mod P for folding across n bits */
+#define CRC_FOLD_128 _mm_set_epi64x( 0xc5b9cd4c, 0xe8a45605 )
+#define CRC_FOLD_512 _mm_set_epi64x( 0x8833794c, 0xe6228b11 )
+
+/* 16 bytes as a polynomial, first bit in the top coefficient */
+__attribute__((target("pclmul")))
+static inline __m128i crc_load( uint8_t *bytes )
+{
+    uint64_t hi, lo;
+    memcpy( &hi, bytes, 8 );
+    memcpy( &lo, bytes + 8, 8 );
+    return _mm_set_epi64x( __builtin_bswap64( hi ), __builtin_bswap64( lo ) );
+}
+
+__attribute__((target("pclmul")))
+static inline __m128i crc_fold( __m128i x, __m128i k, __m128i next )
+{
+    __m128i hi = _mm_clmulepi64_si128( x, k, 0x11 );
+    __m128i lo = _mm_clmulepi64_si128( x, k, 0x00 );
+    return _mm_xor_si128( _mm_xor_si128( hi, lo ), next );
+}
+
+/* The message is folded with carry-less multiplies into a 128-bit value with the same
+ * remainder, whose CRC is then taken with the tables. */
+__attribute__((target("pclmul")))
+static uint32_t crc_32_pclmul( uint8_t *bytes, int length )
+{
+    __m128i x[4];
+    uint64_t out[2];
+    uint8_t rem[16];
+
+    if( length < 64 )
+        return crc_32_c( bytes, length );
+
+    for( int i = 0; i < 4; i++ )
+        x[i] = crc_load( bytes + 16*i );
+    /* initial crc of 0xffffffff */
+    x[0] = _mm_xor_si128( x[0], _mm_set_epi64x( 0xffffffff00000000ULL, 0 ) );
+    bytes += 64;
+    length -= 64;
+
+    for( ; length >= 64; bytes += 64, length -= 64 )
+    {
+        for( int i = 0; i < 4; i++ )
+            x[i] = crc_fold( x[i], CRC_FOLD_512, crc_load( bytes + 16*i ) );
+    }
+
+    x[1] = crc_fold( x[0], CRC_FOLD_128, x[1] );
+    x[2] = crc_fold( x[1], CRC_FOLD_128, x[2] );
+    x[3] = crc_fold( x[2], CRC_FOLD_128, x[3] );
+
+    for( ; length >= 16; bytes += 16, length -= 16 )
+        x[3] = crc_fold( x[3], CRC_FOLD_128, crc_load( bytes ) );
+
+    _mm_storeu_si128( (__m128i*)out, x[3] );
+    for( int i = 0; i < 8; i++ )
+    {
+        rem[i] = out[1] >> (56 - 8*i);
+        rem[8+i] = out[0] >> (56 - 8*i);
+    }
+
+    return crc_update_slice8( crc_update_slice8( 0, rem, 16 ), bytes, length );
+}
+#endif
+
+/* Runs when the library is loaded so that writers in different threads never race on setup */
+__attribute__((constructor))
+static void crc_init( void )
+{
+    for( int i = 0; i < 256; i++ )
+        crc_slice_table[0][i] = crc_table[i];
+
+    for( int k = 1; k < 8; k++ )
+        for( int i = 0; i < 256; i++ )
+            crc_slice_table[k][i] = (crc_slice_table[k-1][i] << 8) ^ crc_table[crc_slice_table[k-1][i] >> 24];
+
+#if HAVE_PCLMUL
+    __builtin_cpu_init();
+    if( __builtin_cpu_supports( "pclmul" ) )
+        crc_32_func = crc_32_pclmul;
+#endif
+}
+
+/* CRC-32/MPEG-2 */
 uint32_t crc_32( uint8_t *bytes, int length )
 {
-   uint32_t crc = 0xffffffff;
-
-   for( int i = 0; i < length; i++ )
-   {
-       int idx = ((crc >> 24) ^ bytes[i]) & 0xff;
-       crc = crc_table[idx] ^ (crc << 8);
-   }
-   return crc;
+    return crc_32_func( bytes, length );
+}
+
+int crc_32_impls( crc_impl_t *impls )
+{
+    int num_impls = 0;
+
+    impls[num_impls++] = (crc_impl_t){ "table", crc_32_table };
+    impls[num_impls++] = (crc_impl_t){ "slice8", crc_32_c };
+#if HAVE_PCLMUL
+    if( __builtin_cpu_supports( "pclmul" ) )
+        impls[num_impls++] = (crc_impl_t){ "pclmul", crc_32_pclmul };
+#endif
+
+    return num_impls;
 }
@@ -23,4 +23,16 @@
 
 uint32_t crc_32( uint8_t *bytes, int length );
 
+typedef struct
+{
+    const char *name;
+    uint32_t (*func)( uint8_t *bytes, int length );
+} crc_impl_t;
+
+#define CRC_MAX_IMPLS 3
+
+/* Fills impls with every implementation this CPU can run, for the cross-check and the benchmark.
+ * Returns the number of implementations */
+int crc_32_impls( crc_impl_t *impls );
+
 #endif
@@ -39,6 +39,8 @@ int ts_setup_hdmv_lpcm_stream( ts_writer_t *w, int pid, int num_channels, int sa
     stream->lpcm_ctx->sample_rate = sample_rate;
     stream->lpcm_ctx->bits_per_sample = bits_per_sample;
 
+    invalidate_pmt( w, stream );
+
     return 0;
 }
 
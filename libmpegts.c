@@ -28,6 +28,8 @@
 #include "smpte/smpte.h"
 #include "crc/crc.h"
 #include <math.h>
+#include <errno.h>
+#include <unistd.h>
 
 static int steam_type_table[26][2] =
 {
@@ -67,22 +69,85 @@ static void write_data_stream_alignment_descriptor( bs_t *s );
 static void write_ac3_descriptor( ts_writer_t *w, bs_t *s, int e_ac3 );
 
 static int check_pcr( ts_writer_t *w, ts_int_program_t *program );
-static void retransmit_psi_and_si( ts_writer_t *w, ts_int_program_t *program, int first );
+static int64_t pcr_margin( ts_writer_t *w );
+static void retransmit_psi_and_si( ts_writer_t *w, int first );
+static void plan_pes( ts_int_pes_t *pes );
+static int adaptation_field_size( ts_int_pes_t *pes, int pes_start, int write_pcr );
 static int write_adaptation_field( ts_writer_t *w, bs_t *s, ts_int_program_t *program, ts_int_pes_t *pes,
                                    int write_pcr, int flags, int stuffing, int discontinuity );
 static void write_pcr_empty( ts_writer_t *w, ts_int_program_t *program, int first );
 
 /* Buffer management */
 static void add_to_buffer( buffer_t *buffer );
-static void drip_buffer( ts_int_program_t *program, int rx, buffer_t *buffer, double next_pcr );
+static void drip_buffer( ts_writer_t *w, int rx, buffer_t *buffer, int64_t next_pcr, int64_t next_pcr_rem );
 
 /* Tables */
+static void write_cached_packet( ts_writer_t *w, packet_cache_t *cache, int *cc );
+static void cache_packet( ts_writer_t *w, packet_cache_t *cache, int start );
+static void write_deleted_count( ts_writer_t *w );
 static void write_pat( ts_writer_t *w );
 static void write_pmt( ts_writer_t *w, ts_int_program_t *program );
 
 static void write_timestamp( bs_t *s, uint64_t timestamp );
+static void patch_timestamp( uint8_t *p, int prefix, uint64_t timestamp );
+static void build_pes_header( ts_int_stream_t *stream, int same_timestamps, pes_header_t *header );
 static int write_pes( ts_writer_t *w, ts_int_program_t *program, ts_frame_t *in_frame, ts_int_pes_t *out_pes );
-static void write_null_packet( ts_writer_t *w );
+static void write_pes_bytes( bs_t *s, ts_int_pes_t *pes, int length );
+static ts_int_pes_t *alloc_pes( ts_writer_t *w, ts_int_stream_t *stream, int size );
+static void free_pes( ts_writer_t *w, ts_int_pes_t *pes );
+static void pool_pes( ts_int_pes_t *pes );
+static int prepare_frames( ts_writer_t *w, ts_frame_t *frames, int num_frames );
+static void build_pes( ts_writer_t *w, ts_int_program_t *program, ts_frame_t *frames, int num_frames );
+#if HAVE_PTHREAD
+static void run_build_jobs( ts_writer_t *w, ts_frame_t *frames, int num_frames );
+static void *build_thread( void *arg );
+#endif
+static void stop_threads( ts_writer_t *w );
+static int ring_init( ts_pes_ring_t *ring, int size );
+static int ring_space( ts_pes_ring_t *ring );
+static int ring_push( ts_pes_ring_t *ring, ts_int_pes_t **pes, int num_pes, int end_batch );
+static int ring_empty( ts_pes_ring_t *ring );
+static ts_int_pes_t *ring_pop( ts_pes_ring_t *ring );
+static int take_ready_pes( ts_writer_t *w );
+static void take_done_pes( ts_writer_t *w );
+static void stop_pipeline( ts_writer_t *w );
+static int packet_size( ts_writer_t *w );
+static int flush_output( ts_writer_t *w, int all );
+static int64_t packets_from( ts_writer_t *w, int pos, int len );
+static void pace_output( ts_writer_t *w, int64_t pcr );
+static void report_diag( ts_writer_t *w, int code, ts_int_pes_t *pes );
+static void print_diag( void *opaque, ts_diag_t *diag );
+static void free_pes_pool( ts_int_stream_t *stream );
+static int is_current( ts_writer_t *w, ts_int_pes_t *pes );
+static int64_t arrival_time( ts_int_pes_t *pes );
+static int64_t pes_deadline( ts_int_pes_t *pes );
+static int pes_before( ts_writer_t *w, ts_int_pes_t *a, ts_int_pes_t *b );
+static void queue_pes( ts_writer_t *w, ts_int_pes_t *pes );
+static void dequeue_pes( ts_writer_t *w, ts_int_program_t *program, ts_int_pes_t *pes );
+static int defer_pes( ts_writer_t *w, ts_int_program_t *program );
+static int is_last_video_pes( ts_writer_t *w, ts_int_pes_t *pes );
+static ts_int_pes_t *find_next_pes( ts_writer_t *w, ts_int_program_t *program, int i, ts_int_pes_t *pes );
+static ts_int_pes_t *find_next_video_pes( ts_writer_t *w, ts_int_pes_t *pes );
+static int64_t packets_until( ts_writer_t *w, int64_t time );
+static int64_t null_run_length( ts_writer_t *w );
+static int write_pcrs( ts_writer_t *w, ts_int_program_t *except );
+
+/* Scheduling heap */
+static void pes_heap_push( ts_int_program_t *program, ts_int_stream_t *stream );
+static void pes_heap_remove( ts_int_program_t *program, ts_int_stream_t *stream );
+static void pes_heap_sift_up( ts_int_program_t *program, int i );
+static void pes_heap_sift_down( ts_int_program_t *program, int i );
+static void write_null_packets( ts_writer_t *w, int64_t num_packets );
+static int is_reserved_pid( ts_main_t *params, int pid );
+static int output_reserve( ts_writer_t *w );
+static int alloc_output_buffer( ts_writer_t *w );
+
+#if HAVE_PROFILE
+static const char * const profile_names[PROFILE_COUNT] =
+{
+    "pes", "schedule", "adaptation_field", "psi", "tstd", "payload", "output", "null_run"
+};
+#endif
 
 ts_writer_t *ts_create_writer( void )
 {
@@ -94,21 +159,27 @@ ts_writer_t *ts_create_writer( void )
         return NULL;
     }
 
+    ts_set_diag_callback( w, NULL, NULL, TS_CLOCK );
+
+#if HAVE_PROFILE
+    w->profile_phase = -1;
+#endif
+
     return w;
 }
 
 int ts_setup_transport_stream( ts_writer_t *w, ts_main_t *params )
 {
-    // TODO check for PID collisions, add MPTS support
     if( params->ts_type < TS_TYPE_DVB || params->ts_type > TS_TYPE_BLU_RAY )
     {
         fprintf( stderr, "Invalid Transport Stream type.\n" );
         return -1;
     }
 
-    if( params->num_programs > 1 )
+    /* the PAT has to fit in one packet */
+    if( params->num_programs < 1 || (params->num_programs + !!params->network_pid) * 4 + 9 > 180 )
     {
-        fprintf( stderr, "Multiple program transport streams are not yet supported.\n" );
+        fprintf( stderr, "Invalid number of programs.\n" );
         return -1;
     }
 
@@ -130,131 +201,200 @@ int ts_setup_transport_stream( ts_writer_t *w, ts_main_t *params )
         return -1;
     }
 
-    BOOLIFY( params->cbr );
-    BOOLIFY( params->legacy_constraints );
-
-    int internal_pcr_pid, video_stream;
-    internal_pcr_pid = video_stream = 0;
-    ts_int_program_t *cur_program = calloc( 1, sizeof(*cur_program) );
-    if( !cur_program )
+    for( int i = 0; i < params->num_programs; i++ )
     {
-        fprintf( stderr, "Malloc failed\n" );
-        return -1;
-    }
-
-    w->num_programs = 1;
-    w->programs[0] = cur_program;
+        ts_program_t *program_in = &params->programs[i];
 
-    cur_program->cur_pcr = TS_START;
-    cur_program->pmt.pid = params->programs[0].pmt_pid;
-    cur_program->program_num = params->programs[0].program_num;
+        if( program_in->pmt_pid < 0x10 || program_in->pmt_pid >= MAX_PIDS - 1 || program_in->pmt_pid == params->network_pid )
+        {
+            fprintf( stderr, "Invalid PMT PID.\n" );
+            return -1;
+        }
 
-    cur_program->cablelabs_is_3d = params->programs[0].cablelabs_is_3d;
-    cur_program->sb_leak_rate = params->programs[0].sb_leak_rate;
-    cur_program->sb_size = params->programs[0].sb_size;
-    cur_program->video_dts = -1;
+        if( !program_in->program_num )
+        {
+            fprintf( stderr, "Invalid program number.\n" );
+            return -1;
+        }
 
-    for( int i = 0; i < params->programs[0].num_streams; i++ )
-    {
-        ts_stream_t *stream_in = &params->programs[0].streams[i];
+        if( program_in->num_streams > MAX_STREAMS )
+        {
+            fprintf( stderr, "Too many streams in program %i.\n", program_in->program_num );
+            return -1;
+        }
 
-        if( stream_in->stream_format == LIBMPEGTS_VIDEO_MPEG2 || stream_in->stream_format == LIBMPEGTS_VIDEO_AVC )
+        for( int j = 0; j < i; j++ )
         {
-            if( !video_stream )
-                video_stream = 1;
-            else
+            if( program_in->pmt_pid == params->programs[j].pmt_pid || program_in->program_num == params->programs[j].program_num )
             {
-                fprintf( stderr, "Multiple video streams not allowed\n" );
+                fprintf( stderr, "Programs must have different PMT PIDs and program numbers.\n" );
                 return -1;
             }
         }
+    }
+
+    BOOLIFY( params->cbr );
+    BOOLIFY( params->legacy_constraints );
+
+    /* separate PCR PIDs, which have no entry in pid_map */
+    uint8_t pcr_only_pids[MAX_PIDS] = { 0 };
+
+    memset( w->pid_map, 0, sizeof(w->pid_map) );
+
+    w->num_programs = 0;
+    w->cur_pcr = TS_START;
+    w->cur_pcr_rem = 0;
 
-        ts_int_stream_t *cur_stream = calloc( 1, sizeof(*cur_stream) );
-        if( !cur_stream )
+    for( int p = 0; p < params->num_programs; p++ )
+    {
+        ts_program_t *program_in = &params->programs[p];
+        int internal_pcr_pid, video_stream;
+        internal_pcr_pid = video_stream = 0;
+        ts_int_program_t *cur_program = calloc( 1, sizeof(*cur_program) );
+        if( !cur_program )
         {
             fprintf( stderr, "Malloc failed\n" );
             return -1;
         }
 
-        cur_stream->pid = stream_in->pid;
-        cur_stream->stream_format = stream_in->stream_format;
-        for( int j = 0; steam_type_table[j][0] != 0; j++ )
+        w->programs[w->num_programs++] = cur_program;
+
+        cur_program->pmt.pid = program_in->pmt_pid;
+        cur_program->program_num = program_in->program_num;
+
+        cur_program->cablelabs_is_3d = program_in->cablelabs_is_3d;
+        cur_program->sb_leak_rate = program_in->sb_leak_rate;
+        cur_program->sb_size = program_in->sb_size;
+        cur_program->video_dts = -1;
+
+        for( int i = 0; i < program_in->num_streams; i++ )
         {
-            if( cur_stream->stream_format == steam_type_table[j][0] )
+            ts_stream_t *stream_in = &program_in->streams[i];
+
+            if( is_reserved_pid( params, stream_in->pid ) )
             {
-                /* DVB AC-3 and EAC-3 are different */
-                if( w->ts_type == TS_TYPE_DVB &&
-                    ( cur_stream->stream_format == LIBMPEGTS_AUDIO_AC3 || cur_stream->stream_format == LIBMPEGTS_AUDIO_EAC3 ) )
-                    j++;
+                fprintf( stderr, "Invalid PID %i.\n", stream_in->pid );
+                return -1;
+            }
 
-                cur_stream->stream_type = steam_type_table[j][1];
-                break;
+            if( w->pid_map[stream_in->pid] || pcr_only_pids[stream_in->pid] )
+            {
+                fprintf( stderr, "PID %i is used by more than one stream.\n", stream_in->pid );
+                return -1;
             }
-        }
 
-        if( !cur_stream->stream_type )
-        {
-            fprintf( stderr, "Unsupported Stream Format\n" );
-            return -1;
-        }
+            if( stream_in->stream_format == LIBMPEGTS_VIDEO_MPEG2 || stream_in->stream_format == LIBMPEGTS_VIDEO_AVC )
+            {
+                if( !video_stream )
+                    video_stream = 1;
+                else
+                {
+                    fprintf( stderr, "Multiple video streams not allowed\n" );
+                    return -1;
+                }
+            }
 
-        if( stream_in->write_lang_code )
-        {
-            cur_stream->write_lang_code = 1;
-            memcpy( cur_stream->lang_code, stream_in->lang_code, 4 );
-        }
+            ts_int_stream_t *cur_stream = calloc( 1, sizeof(*cur_stream) );
+            if( !cur_stream )
+            {
+                fprintf( stderr, "Malloc failed\n" );
+                return -1;
+            }
 
-        cur_stream->audio_type = stream_in->audio_type;
+            cur_stream->pid = stream_in->pid;
+            cur_stream->program = cur_program;
+            cur_stream->stream_format = stream_in->stream_format;
+            if( cur_stream->stream_format == LIBMPEGTS_VIDEO_MPEG2 || cur_stream->stream_format == LIBMPEGTS_VIDEO_AVC )
+                cur_program->video_stream = cur_stream;
+            for( int j = 0; steam_type_table[j][0] != 0; j++ )
+            {
+                if( cur_stream->stream_format == steam_type_table[j][0] )
+                {
+                    /* DVB AC-3 and EAC-3 are different */
+                    if( w->ts_type == TS_TYPE_DVB &&
+                        ( cur_stream->stream_format == LIBMPEGTS_AUDIO_AC3 || cur_stream->stream_format == LIBMPEGTS_AUDIO_EAC3 ) )
+                        j++;
 
-        if( cur_stream->pid == params->programs[0].pcr_pid )
-        {
-            cur_program->pcr_stream = cur_stream;
-            internal_pcr_pid = 1;
-        }
+                    cur_stream->stream_type = steam_type_table[j][1];
+                    break;
+                }
+            }
+
+            if( !cur_stream->stream_type )
+            {
+                fprintf( stderr, "Unsupported Stream Format\n" );
+                return -1;
+            }
+
+            if( stream_in->write_lang_code )
+            {
+                cur_stream->write_lang_code = 1;
+                memcpy( cur_stream->lang_code, stream_in->lang_code, 4 );
+            }
 
-        cur_stream->stream_id = stream_in->stream_id;
-        cur_stream->max_frame_size = stream_in->max_frame_size;
+            cur_stream->audio_type = stream_in->audio_type;
 
-        if( stream_in->has_stream_identifier )
-        {
-            cur_stream->has_stream_identifier = 1;
-            cur_stream->stream_identifier = stream_in->stream_identifier & 0xff;
-        }
+            if( cur_stream->pid == program_in->pcr_pid )
+            {
+                cur_program->pcr_stream = cur_stream;
+                internal_pcr_pid = 1;
+            }
+
+            cur_stream->stream_id = stream_in->stream_id;
+            cur_stream->max_frame_size = stream_in->max_frame_size;
+
+            if( stream_in->has_stream_identifier )
+            {
+                cur_stream->has_stream_identifier = 1;
+                cur_stream->stream_identifier = stream_in->stream_identifier & 0xff;
+            }
 
-        cur_stream->dvb_au = stream_in->dvb_au;
-        cur_stream->dvb_au_frame_rate = stream_in->dvb_au_frame_rate;
+            cur_stream->dvb_au = stream_in->dvb_au;
+            cur_stream->dvb_au_frame_rate = stream_in->dvb_au_frame_rate;
 
-        cur_stream->hdmv_frame_rate = stream_in->hdmv_frame_rate;
-        cur_stream->hdmv_aspect_ratio = stream_in->hdmv_aspect_ratio;
-        cur_stream->hdmv_video_format = stream_in->hdmv_video_format;
+            cur_stream->hdmv_frame_rate = stream_in->hdmv_frame_rate;
+            cur_stream->hdmv_aspect_ratio = stream_in->hdmv_aspect_ratio;
+            cur_stream->hdmv_video_format = stream_in->hdmv_video_format;
 
-        cur_stream->tb.buf_size = TB_SIZE;
+            cur_stream->tb.buf_size = TB_SIZE;
 
-        /* setup T-STD buffers when audio buffers sizes are independent of number of channels */
-        if( cur_stream->stream_format == LIBMPEGTS_AUDIO_MPEG1 || cur_stream->stream_format == LIBMPEGTS_AUDIO_MPEG2 )
-        {
-            /* use the defaults */
-            cur_stream->rx = MISC_AUDIO_RXN;
-            cur_stream->mb.buf_size = MISC_AUDIO_BS;
+            /* setup T-STD buffers when audio buffers sizes are independent of number of channels */
+            if( cur_stream->stream_format == LIBMPEGTS_AUDIO_MPEG1 || cur_stream->stream_format == LIBMPEGTS_AUDIO_MPEG2 )
+            {
+                /* use the defaults */
+                cur_stream->rx = MISC_AUDIO_RXN;
+                cur_stream->mb.buf_size = MISC_AUDIO_BS;
+            }
+            else if( cur_stream->stream_format == LIBMPEGTS_AUDIO_AC3 || cur_stream->stream_format == LIBMPEGTS_AUDIO_EAC3 )
+            {
+                cur_stream->rx = MISC_AUDIO_RXN;
+                cur_stream->mb.buf_size = w->ts_type == TS_TYPE_ATSC || w->ts_type == TS_TYPE_CABLELABS ? AC3_BS_ATSC : AC3_BS_DVB;
+            }
+
+            cur_program->streams[cur_program->num_streams] = cur_stream;
+            cur_program->num_streams++;
+            w->pid_map[cur_stream->pid] = cur_stream;
         }
-        else if( cur_stream->stream_format == LIBMPEGTS_AUDIO_AC3 || cur_stream->stream_format == LIBMPEGTS_AUDIO_EAC3 )
+
+        /* create separate PCR stream if necessary */
+        if( !internal_pcr_pid )
         {
-            cur_stream->rx = MISC_AUDIO_RXN;
-            cur_stream->mb.buf_size = w->ts_type == TS_TYPE_ATSC || w->ts_type == TS_TYPE_CABLELABS ? AC3_BS_ATSC : AC3_BS_DVB;
-        }
+            if( is_reserved_pid( params, program_in->pcr_pid ) || w->pid_map[program_in->pcr_pid] ||
+                pcr_only_pids[program_in->pcr_pid] )
+            {
+                fprintf( stderr, "Invalid PCR PID.\n" );
+                return -1;
+            }
+            pcr_only_pids[program_in->pcr_pid] = 1;
 
-        cur_program->streams[cur_program->num_streams] = cur_stream;
-        cur_program->num_streams++;
-    }
+            ts_int_stream_t *pcr_stream = calloc( 1, sizeof(*pcr_stream) );
+            if( !pcr_stream )
+                return -1;
+            pcr_stream->pid = program_in->pcr_pid;
+            pcr_stream->program = cur_program;
+            cur_program->pcr_stream = pcr_stream;
+        }
 
-    /* create separate PCR stream if necessary */
-    if( !internal_pcr_pid )
-    {
-        ts_int_stream_t *pcr_stream = calloc( 1, sizeof(*pcr_stream) );
-        if( !pcr_stream )
-            return -1;
-        pcr_stream->pid = params->programs[0].pcr_pid;
-        cur_program->pcr_stream = pcr_stream;
     }
 
     w->ts_id = params->ts_id;
@@ -274,13 +414,76 @@ int ts_setup_transport_stream( ts_writer_t *w, ts_main_t *params )
     w->rx_sys = RX_SYS;
     w->r_sys = MAX( R_SYS_DEFAULT, (double)w->ts_muxrate / 500 );
 
-    // FIXME realloc if necessary
+    w->out.reserve = output_reserve( w );
+    if( w->out.user_buffer && w->out.i_bitstream < w->out.reserve )
+    {
+        fprintf( stderr, "Output buffer must be at least %i bytes\n", w->out.reserve );
+        return -1;
+    }
+
+    if( !w->out.user_buffer && alloc_output_buffer( w ) < 0 )
+        return -1;
+
+    return 0;
+}
+
+/* The internal output buffer is allocated once and never grows while muxing. It holds a second of output,
+ * and with an output callback at least one chunk as well as a pass of the mux loop */
+static int alloc_output_buffer( ts_writer_t *w )
+{
+    int size = MAX( w->ts_muxrate >> 3, w->out.reserve );
+
+    if( w->out.write_packets )
+        size = MAX( size, w->out.chunk_packets * packet_size( w ) + w->out.reserve );
+
+    if( w->out.p_bitstream && w->out.i_bitstream >= size )
+        return 0;
 
-    w->out.i_bitstream = w->ts_muxrate >> 3;
-    w->out.p_bitstream = calloc( 1, w->out.i_bitstream );
+    free( w->out.p_bitstream );
+    w->out.p_bitstream = calloc( 1, size );
+    w->out.i_bitstream = w->out.p_bitstream ? size : 0;
 
     if( !w->out.p_bitstream )
+    {
+        fprintf( stderr, "Malloc failed\n" );
         return -1;
+    }
+
+    return 0;
+}
+
+/* Most bytes written by one pass of the mux loop, or by the first call before the loop: a pes packet,
+ * the PAT and the PMTs, and the PCRs of every program. PCRs of a program are at least the PCR period
+ * minus one packet per program apart, so a program only has more than one in a pass at low muxrates */
+static int output_reserve( ts_writer_t *w )
+{
+    int tables = w->num_programs + 2;
+    int64_t gap = w->pcr_period * 27000LL * w->ts_muxrate / (TS_PACKET_SIZE * 8 * TS_CLOCK) - 2 * w->num_programs;
+    int pcrs = 1; /* per program */
+
+    while( pcrs < tables )
+    {
+        int64_t packets = tables + w->num_programs * pcrs;
+        int64_t max_pcrs = gap > 0 ? 1 + (packets - 1) / gap : tables;
+        if( max_pcrs <= pcrs )
+            break;
+        pcrs = MIN( max_pcrs, tables );
+    }
+
+    return MAX( (tables + w->num_programs * pcrs) * (TS_PACKET_SIZE + 4), LIBMPEGTS_MIN_OUTPUT_SIZE );
+}
+
+/* PIDs which cannot carry an elementary stream or PCR */
+static int is_reserved_pid( ts_main_t *params, int pid )
+{
+    if( pid < 0x10 || pid >= MAX_PIDS - 1 || pid == params->network_pid )
+        return 1;
+
+    for( int i = 0; i < params->num_programs; i++ )
+    {
+        if( pid == params->programs[i].pmt_pid )
+            return 1;
+    }
 
     return 0;
 }
@@ -397,6 +600,8 @@ int ts_setup_mpegvideo_stream( ts_writer_t *w, int pid, int level, int profile,
         stream->rbx = 1200 * avc_levels[level_idx].bitrate;
     }
 
+    invalidate_pmt( w, stream );
+
     return 0;
 }
 
@@ -440,6 +645,8 @@ int ts_setup_mpeg4_aac_stream( ts_writer_t *w, int pid, int profile_and_level, i
         }
     }
 
+    invalidate_pmt( w, stream );
+
     return 0;
 };
 
@@ -484,6 +691,8 @@ int ts_setup_302m_stream( ts_writer_t *w, int pid, int bit_depth, int num_channe
     /* 302M frame size is bit_depth / 4 + 1 */
     stream->rx = 1.2 * ((bit_depth >> 2) + 1) * SMPTE_302M_AUDIO_SR * 8;
 
+    invalidate_pmt( w, stream );
+
     return 0;
 }
 
@@ -532,6 +741,8 @@ int setup_dvb_subtitles( ts_writer_t *w, int pid, int has_dds, int num_subtitles
         stream->mb.buf_size = DVB_SUB_MB_SIZE;
     }
 
+    invalidate_pmt( w, stream );
+
     return 0;
 }
 
@@ -571,23 +782,25 @@ int setup_dvb_teletext( ts_writer_t *w, int pid, int num_teletexts, ts_dvb_sub_t
     stream->rx = TELETEXT_RXN;
     stream->mb.buf_size = TELETEXT_BTTX;
 
+    invalidate_pmt( w, stream );
+
     return 0;
 }
 
 int ts_write_frames( ts_writer_t *w, ts_frame_t *frames, int num_frames, uint8_t **out, int *len )
 {
-    ts_int_program_t *program = w->programs[0];
+    ts_int_program_t *program;
     ts_int_stream_t *stream;
 
-    int cur_num_pes = w->num_buffered_frames;
-    ts_int_pes_t **cur_pes = w->buffered_frames; // FIXME improve name
-    int64_t video_dts = program->video_dts;
+    /* the previously buffered frames are written during this call unless the last call ran out of space
+     * or the output callback failed */
+    int resume = w->num_cur_pes > 0 || w->out.unsent > 0;
+    int cur_num_pes = resume ? w->num_cur_pes : w->num_buffered_frames;
 
     int stuffing, flags, pkt_bytes_left, write_pcr, write_adapt_field, adapt_field_len, pes_start, running;
-    uint8_t temp[200];
-    bs_t q;
     bs_t *s = &w->out.bs;
     bs_init( s, w->out.p_bitstream, w->out.i_bitstream );
+    s->p += w->out.unsent; /* offered to the output callback again */
 
     if( num_frames < 0 )
     {
@@ -595,167 +808,128 @@ int ts_write_frames( ts_writer_t *w, ts_frame_t *frames, int num_frames, uint8_t
         return -1;
     }
 
-    if( num_frames )
+    if( resume && num_frames )
     {
-        w->num_buffered_frames = num_frames;
-        w->buffered_frames = calloc( 1, num_frames * sizeof(w->buffered_frames) );
-        if( !w->buffered_frames )
-        {
-           fprintf( stderr, "Malloc failed\n" );
-           return -1;
-        }
+        fprintf( stderr, "Output is pending. Call ts_write_frames without frames until it is complete\n" );
+        return -1;
     }
 
-    for( int i = 0; i < num_frames; i++ )
+    if( w->pipeline && num_frames )
     {
-        stream = find_stream( w, frames[i].pid );
-
-        if( !stream )
-        {
-            fprintf( stderr, "PID %i not found for frame %i\n", frames[i].pid, i );
-            return -1;
-        }
-
-        /* Codec specific parameters */
-        if( stream->stream_format == LIBMPEGTS_VIDEO_MPEG2 || stream->stream_format == LIBMPEGTS_VIDEO_AVC )
-        {
-            if( !stream->mpegvideo_ctx )
-            {
-               fprintf( stderr, "MPEG video stream needs additional information. Call ts_setup_mpegvideo_stream \n" );
-               return -1;
-            }
-            program->video_dts = frames[i].dts;
-        }
-
-        w->buffered_frames[i] = calloc( 1, sizeof(ts_int_pes_t) );
-        if( !w->buffered_frames[i] )
-        {
-           fprintf( stderr, "Malloc failed\n" );
-           return -1;
-        }
-
-        w->buffered_frames[i]->stream = stream;
-        w->buffered_frames[i]->random_access = !!frames[i].random_access;
-        w->buffered_frames[i]->priority = !!frames[i].priority;
-        w->buffered_frames[i]->dts = frames[i].dts;
-        w->buffered_frames[i]->pts = frames[i].pts;
-        w->buffered_frames[i]->frame_type = frames[i].frame_type;
-        w->buffered_frames[i]->ref_pic_idc = frames[i].ref_pic_idc;
-        w->buffered_frames[i]->write_pulldown_info = frames[i].write_pulldown_info;
-        w->buffered_frames[i]->pic_struct = frames[i].pic_struct;
+        fprintf( stderr, "Frames must be passed to ts_queue_frames when pipelined\n" );
+        return -1;
+    }
 
-        /* probe the first normal looking ac3 frame if extra data is needed */
-        if( !stream->atsc_ac3_ctx && stream->stream_format == LIBMPEGTS_AUDIO_AC3 &&
-            ( w->ts_type == TS_TYPE_CABLELABS || w->ts_type == TS_TYPE_ATSC ) &&
-            frames[i].size > 100 &&  frames[i].data[0] == 0xb && frames[i].data[1] == 0x77 )
-        {
-            stream->atsc_ac3_ctx = calloc( 1, sizeof(ts_atsc_ac3_info) );
-            if( !stream->atsc_ac3_ctx  )
-            {
-               fprintf( stderr, "Malloc failed\n" );
-               return -1;
-            }
-            parse_ac3_frame( stream->atsc_ac3_ctx, frames[i].data );
-        }
+    /* when pipelined each call takes the frames of one call of ts_queue_frames */
+    if( w->pipeline && !resume && ring_empty( &w->ready_pes ) )
+    {
+        *len = 0;
+        return 0;
+    }
 
-        /* 512 bytes is more than enough for pes overhead */
-        w->buffered_frames[i]->data = calloc( 1, frames[i].size + 512 );
-        if( !w->buffered_frames[i]->data )
-        {
-           fprintf( stderr, "Malloc failed\n" );
-           return -1;
-        }
+    if( !resume )
+    {
+        w->write_idx++;
+        w->new_frames = num_frames > 0;
+    }
 
-        w->buffered_frames[i]->header_size = write_pes( w, program, &frames[i], w->buffered_frames[i] );
+    if( w->pipeline )
+    {
+        if( !resume && take_ready_pes( w ) )
+            w->new_frames = 1;
+    }
+    else
+    {
+        /* the frames before an invalid one are still queued */
+        int num_built = prepare_frames( w, frames, num_frames );
+        for( int i = 0; i < num_built; i++ )
+            queue_pes( w, w->frame_pes[i] );
+        if( num_built < num_frames )
+            return -1;
     }
 
     if( !cur_num_pes )
     {
+        /* at most the packets which the output callback did not take are left */
+        if( w->out.write_packets && flush_output( w, 1 ) < 0 )
+            return -1;
         out = NULL;
         *len = 0;
         return 0;
     }
 
+    if( !resume )
+    {
+        for( int i = 0; i < w->num_programs; i++ )
+        {
+            program = w->programs[i];
+            program->num_pes_heap = 0;
+            for( int j = 0; j < program->num_streams; j++ )
+            {
+                stream = program->streams[j];
+                if( stream->stream_format > 31 && stream->pes_head && is_current( w, stream->pes_head ) )
+                    pes_heap_push( program, stream );
+            }
+        }
+    }
+
     write_pcr = 0;
     running = 1;
 
     if( !w->first_input )
     {
-        write_pcr_empty( w, program, 1 );
-        retransmit_psi_and_si( w, program, 1 );
+        for( int i = 0; i < w->num_programs; i++ )
+            write_pcr_empty( w, w->programs[i], 1 );
+        retransmit_psi_and_si( w, 1 );
         w->first_input = 1;
     }
 
-    /* earliest arrival time that the pes packet can arrive */
-    double pes_pcr = 0;
-
     while( cur_num_pes )
     {
         ts_int_pes_t *pes = NULL;
         write_adapt_field = adapt_field_len = write_pcr = 0;
         pkt_bytes_left = 184;
 
-        if( w->out.bs.p_end - w->out.bs.p < 18800 )
+        /* pass on complete chunks as soon as they are written */
+        if( w->out.write_packets && bs_pos( s ) >= w->out.chunk_packets * 8 * packet_size( w ) )
         {
-            bs_flush( s );
-            uint8_t *bs_bak = w->out.p_bitstream;
-            w->out.i_bitstream += 100000;
-            w->out.p_bitstream = realloc( w->out.p_bitstream, w->out.i_bitstream );
-
-            if( !w->out.p_bitstream )
+            if( flush_output( w, 0 ) < 0 )
+            {
+                w->num_cur_pes = cur_num_pes;
                 return -1;
-
-            intptr_t delta = w->out.p_bitstream - bs_bak;
-
-            w->out.bs.p_start += delta;
-            w->out.bs.p += delta;
-            w->out.bs.p_end = w->out.p_bitstream + w->out.i_bitstream;
-            bs_realign( s );
+            }
         }
 
+        /* stop at a packet boundary and carry on during the next call */
+        if( w->out.bs.p_end - w->out.bs.p < w->out.reserve )
+            break;
+
         /* check for any queued PMT packets */
 
-        // FIXME at low bitrates this might need tweaking
+        PROFILE_START( w, PROFILE_SCHEDULE );
 
-        /* check all the non-video packets first */
-        for( int i = 0; i < cur_num_pes; i++ )
-        {
-            if( !pes || cur_pes[i]->dts < pes->dts )
-            {
-                stream = cur_pes[i]->stream;
-                pes_pcr = (double)(cur_pes[i]->dts - stream->max_frame_size)/90000; /* earliest that a frame can arrive */
-                if( cur_pes[i]->stream->stream_format > 31 && program->cur_pcr >= pes_pcr && cur_pes[i]->stream->tb.cur_buf == 0.0 )
-                    pes = cur_pes[i];
-            }
-        }
+        /* check all the non-video packets first, across all programs */
+        for( int i = 0; i < w->num_programs; i++ )
+            pes = find_next_pes( w, w->programs[i], 0, pes );
 
-        /* See if we can write a video packet if non-audio packets can't be written */
-        if( !pes )
-        {
-            for( int i = 0; i < cur_num_pes; i++ )
-            {
-                stream = cur_pes[i]->stream;
-                if( stream->stream_format == LIBMPEGTS_VIDEO_MPEG2 || stream->stream_format == LIBMPEGTS_VIDEO_AVC )
-                {
-                    pes_pcr = (double)(cur_pes[i]->dts - stream->max_frame_size)/90000; /* earliest that a frame can arrive */
-                    if( program->cur_pcr >= pes_pcr && cur_pes[i]->stream->tb.cur_buf == 0.0 )
-                        pes = cur_pes[i];
-                    break;
-                }
-            }
-        }
+        /* See if we can write a video packet if non-audio packets can't be written.
+         * EDF weighs the video against the non-video, which starves the video at low bitrates otherwise */
+        if( !pes || w->scheduler == LIBMPEGTS_SCHEDULER_EDF )
+            pes = find_next_video_pes( w, pes );
+
+        PROFILE_STOP( w, PROFILE_SCHEDULE );
 
         if( pes )
         {
             stream = pes->stream;
-            pes_pcr = (double)(pes->dts - stream->max_frame_size)/90000; /* earliest that a frame can arrive */
-            pes_start = pes->data == pes->cur_pos; /* flag if packet contains pes header */
+            program = stream->program;
+            pes_start = pes->bytes_left == pes->size; /* flag if packet contains pes header */
 
-            // FIXME complain less
-            if( (double)pes->dts/90000 < program->cur_pcr )
-                fprintf( stderr, "\n dts is less than pcr pid: %i dts: %f pcr: %f \n", pes->stream->pid, (double)pes->dts/90000, program->cur_pcr);
+            if( pes->dts * 300 < w->cur_pcr )
+                report_diag( w, LIBMPEGTS_DIAG_DTS_BEFORE_PCR, pes );
 
-            bs_init( &q, temp, 256 );
+            /* PCRs of the other programs which are due can't wait for this packet */
+            write_pcrs( w, program );
 
             /* it is good practice to write a pcr at the beginning of a video payload */
             if( program->pcr_stream == stream && pes_start )
@@ -771,19 +945,8 @@ int ts_write_frames( ts_writer_t *w, ts_frame_t *frames, int num_frames, uint8_t
                     write_pcr_empty( w, program, 0 );
             }
 
-            if( write_pcr )
-            {
-                adapt_field_len = write_adaptation_field( w, &q, program, pes, write_pcr, 1, 0, 0 );
-                pkt_bytes_left -= adapt_field_len;
-            }
-
-            /* DVB AU_Information is large so consider this case */
-            // FIXME consider cablelabs legacy
-            if( !adapt_field_len && pes_start && stream->dvb_au )
-            {
-                adapt_field_len = write_adaptation_field( w, &q, program, pes, 0, 1, 0, 0 );
-                pkt_bytes_left -= adapt_field_len;
-            }
+            adapt_field_len = adaptation_field_size( pes, pes_start, write_pcr );
+            pkt_bytes_left -= adapt_field_len;
 
             if( pes->bytes_left >= pkt_bytes_left )
             {
@@ -791,9 +954,9 @@ int ts_write_frames( ts_writer_t *w, ts_frame_t *frames, int num_frames, uint8_t
                 if( adapt_field_len )
                     write_adaptation_field( w, s, program, pes, write_pcr, 1, 0, 0 );
 
-                write_bytes( s, pes->cur_pos, pkt_bytes_left );
-                pes->cur_pos += pkt_bytes_left;
-                pes->bytes_left -= pkt_bytes_left;
+                PROFILE_START( w, PROFILE_PAYLOAD );
+                write_pes_bytes( s, pes, pkt_bytes_left );
+                PROFILE_STOP( w, PROFILE_PAYLOAD );
                 add_to_buffer( &stream->tb );
                 increase_pcr( w, 1 );
             }
@@ -820,8 +983,9 @@ int ts_write_frames( ts_writer_t *w, ts_frame_t *frames, int num_frames, uint8_t
                 if( adapt_field_len )
                     write_adaptation_field( w, s, program, pes, write_pcr, flags, stuffing, 0 );
 
-                write_bytes(s, pes->cur_pos, pes->bytes_left );
-                pes->bytes_left = 0;
+                PROFILE_START( w, PROFILE_PAYLOAD );
+                write_pes_bytes( s, pes, pes->bytes_left );
+                PROFILE_STOP( w, PROFILE_PAYLOAD );
                 add_to_buffer( &stream->tb );
                 increase_pcr( w, 1 );
             }
@@ -829,65 +993,55 @@ int ts_write_frames( ts_writer_t *w, ts_frame_t *frames, int num_frames, uint8_t
             if( pes->bytes_left <= pes->handover_bytes_left )
             {
                 /* When a video frame arrives and the associated non-video packets are not ready to be written send frames to next context
-                 * This happens at the beginning of a transport stream as the video buffers  */
-                if( num_frames && (pes->stream->stream_format == LIBMPEGTS_VIDEO_MPEG2 || pes->stream->stream_format == LIBMPEGTS_VIDEO_AVC) )
+                 * This happens at the beginning of a transport stream as the video buffers.
+                 * With several programs this waits for the last video frame of the call, otherwise non-video frames
+                 * of the programs which finish first would be held back while the clock moves on */
+                if( w->new_frames && (pes->stream->stream_format == LIBMPEGTS_VIDEO_MPEG2 || pes->stream->stream_format == LIBMPEGTS_VIDEO_AVC) &&
+                    is_last_video_pes( w, pes ) )
                 {
-                    for( int i = 0; i < cur_num_pes; i++ )
-                    {
-                        if( cur_pes[i]->stream->stream_format > 31 )
-                        {
-                            stream = cur_pes[i]->stream;
-                            pes_pcr = (double)(cur_pes[i]->dts - stream->max_frame_size)/90000; /* earliest that a frame can arrive */
-                            if( pes_pcr > program->cur_pcr )
-                            {
-                                w->buffered_frames = realloc( w->buffered_frames, (w->num_buffered_frames+1) * sizeof(w->buffered_frames) );
-                                w->buffered_frames[w->num_buffered_frames++] = cur_pes[i];
-                                memmove( &cur_pes[i], &cur_pes[i+1], (cur_num_pes-1-i) * sizeof(cur_pes) );
-                                cur_num_pes--;
-                                i--; /* check current position again */
-                            }
-                        }
-                    }
+                    for( int i = 0; i < w->num_programs; i++ )
+                        cur_num_pes -= defer_pes( w, w->programs[i] );
                 }
 
+                if( !pes->bytes_left && stream->max_delay && w->cur_pcr - arrival_time( pes ) > stream->max_delay )
+                    report_diag( w, LIBMPEGTS_DIAG_MAX_DELAY, pes );
+
                 /* eject the current pes from the queue */
-                for( int i = 0; i < cur_num_pes; i++ )
-                {
-                    if( cur_pes[i] == pes )
-                    {
-                        cur_num_pes--;
-                        memmove( &cur_pes[i], &cur_pes[i+1], (cur_num_pes-i) * sizeof(cur_pes) );
-                        break;
-                    }
-                }
+                dequeue_pes( w, program, pes );
+                cur_num_pes--;
 
                 if( pes->handover_bytes_left )
                     pes->handover_bytes_left = 0;
                 else
-                {
-                    free( pes->data );
-                    free( pes );
-                }
+                    free_pes( w, pes );
             }
 
-            if( check_pcr( w, program ) )
-                write_pcr_empty( w, program, 0 );
-            retransmit_psi_and_si( w, program, 0 );
+            write_pcrs( w, NULL );
+            retransmit_psi_and_si( w, 0 );
         }
         else /* no packets can be written */
         {
-            if( check_pcr( w, program ) )
-                write_pcr_empty( w, program, 0 );
-            else if( w->cbr )
-                write_null_packet( w );
-            else
-                increase_pcr( w, 1 ); /* write imaginary packet in vbr mode */
+            if( !write_pcrs( w, NULL ) )
+            {
+                /* nothing can happen until a pes may be written or a PCR is due, so skip ahead in one go */
+                PROFILE_START( w, PROFILE_NULL_RUN );
+                int64_t run = null_run_length( w );
+
+                if( w->cbr )
+                    write_null_packets( w, run );
+                else
+                    increase_pcr( w, run ); /* write imaginary packets in vbr mode */
+                PROFILE_STOP( w, PROFILE_NULL_RUN );
+            }
         }
     }
 
-    bs_flush( s );
+    bs_flush_bytes( s );
+
+    w->num_cur_pes = cur_num_pes;
 
-    free( cur_pes );
+    if( w->out.write_packets && flush_output( w, 1 ) < 0 )
+        return -1;
 
     *out = w->out.p_bitstream;
     *len = bs_pos( s ) >> 3;
@@ -895,763 +1049,2425 @@ int ts_write_frames( ts_writer_t *w, ts_frame_t *frames, int num_frames, uint8_t
     // TODO if it's the final packet write blu-ray overflows
     // TODO count bits here
 
-    return 0;
+    return cur_num_pes ? LIBMPEGTS_OUTPUT_FULL : 0;
 }
 
-int ts_delete_stream( ts_writer_t *w, int pid )
+int ts_set_output_buffer( ts_writer_t *w, uint8_t *buf, int size )
 {
-    return 0;
-}
+    if( buf && size < ts_get_min_output_size( w ) )
+    {
+        fprintf( stderr, "Output buffer must be at least %i bytes\n", ts_get_min_output_size( w ) );
+        return -1;
+    }
 
-int ts_close_writer( ts_writer_t *w )
-{
-    for( int i = 0; i < w->num_programs; i++ )
+    if( buf && w->out.write_packets )
     {
-        for( int j = 0; j < w->programs[i]->num_streams; j++ )
-        {
-            // TODO free other stuff
-            free( w->programs[i]->streams[j] );
-            if( w->programs[i]->streams[j]->mpegvideo_ctx )
-                free( w->programs[i]->streams[j]->mpegvideo_ctx );
-            if( w->programs[i]->streams[j]->lpcm_ctx )
-                free( w->programs[i]->streams[j]->lpcm_ctx );
-            if( w->programs[i]->streams[j]->atsc_ac3_ctx )
-                free( w->programs[i]->streams[j]->atsc_ac3_ctx );
-            if( w->programs[i]->streams[j]->dvb_sub_ctx )
-                free( w->programs[i]->streams[j]->dvb_sub_ctx );
-        }
+        fprintf( stderr, "An output buffer cannot be used with an output callback\n" );
+        return -1;
     }
 
-    if( w->out.p_bitstream )
+    if( !w->out.user_buffer && w->out.p_bitstream )
         free( w->out.p_bitstream );
-    free( w );
+
+    w->out.p_bitstream = buf;
+    w->out.i_bitstream = buf ? size : 0;
+    w->out.user_buffer = !!buf;
+
+    /* otherwise ts_setup_transport_stream allocates it */
+    if( !buf && w->ts_muxrate && alloc_output_buffer( w ) < 0 )
+        return -1;
 
     return 0;
 }
 
-void write_packet_header( ts_writer_t *w, int start, int pid, int adapt_field, int *cc )
+int ts_get_min_output_size( ts_writer_t *w )
 {
-    bs_t *s = &w->out.bs;
+    return w->num_programs ? w->out.reserve : LIBMPEGTS_MIN_OUTPUT_SIZE;
+}
 
-    if( w->ts_type == TS_TYPE_BLU_RAY )
+int ts_set_output_callback( ts_writer_t *w, int (*write_packets)( void *opaque, uint8_t *data, int len ),
+                            void *opaque, int chunk_packets )
+{
+    if( write_packets && chunk_packets <= 0 )
     {
-        // tp_extra_header
-        bs_write( s, 2, 0 ); // copy_permission_indicator
-        bs_write( s, 30, 0 ); // arrival_time_stamp FIXME
+        fprintf( stderr, "Invalid number of packets per chunk\n" );
+        return -1;
     }
 
-    bs_write( s, 8, 0x47 ); // sync byte
-    bs_write1( s, 0 );      // transport_error_indicator
-    bs_write1( s, start );  // payload_unit_start_indicator
-    bs_write1( s, 0 );      // transport_priority (not usually used)
-    bs_write( s, 5, (pid >> 8) & 0x1f ); // PID
-    bs_write( s, 8, pid & 0xff );        // PID
-    bs_write( s, 2, 0 );    // transport_scrambling_control
-    bs_write( s, 2, adapt_field & 0x03 );
+    if( write_packets && w->out.user_buffer )
+    {
+        fprintf( stderr, "An output callback cannot be used with an output buffer\n" );
+        return -1;
+    }
 
-    if( adapt_field == ADAPT_FIELD_ONLY )
-        bs_write( s, 4, (*cc - 1) & 0xf ); // continuity counter
-    else
-        bs_write( s, 4, (*cc)++ & 0xf );   // continuity counter
+    if( w->num_cur_pes || w->out.unsent )
+    {
+        fprintf( stderr, "Output is pending. Call ts_write_frames without frames until it is complete\n" );
+        return -1;
+    }
+
+    w->out.write_packets = write_packets;
+    w->out.write_opaque = opaque;
+    w->out.chunk_packets = chunk_packets;
+
+    /* a larger chunk than the buffer holds needs a larger buffer, allocated here rather than while muxing */
+    if( write_packets && w->ts_muxrate && alloc_output_buffer( w ) < 0 )
+        return -1;
+
+    return 0;
 }
 
-int write_padding( bs_t *s, int start )
+int ts_set_pacing( ts_writer_t *w, int enable, int spin_ns )
 {
-    bs_flush( s );
-    uint8_t *p_start = s->p_start;
-    int padding_bytes = TS_PACKET_SIZE - (bs_pos( s ) - start) / 8;
+    if( enable && !w->out.write_packets )
+    {
+        fprintf( stderr, "Pacing needs an output callback. Call ts_set_output_callback\n" );
+        return -1;
+    }
 
-    memset( s->p, 0xff, padding_bytes );
-    s->p += padding_bytes;
+    if( spin_ns < 0 )
+    {
+        fprintf( stderr, "Invalid spin time\n" );
+        return -1;
+    }
 
-    bs_init( s, s->p, s->p_end - s->p );
-    s->p_start = p_start;
+    memset( &w->pacing, 0, sizeof(w->pacing) );
+    w->pacing.enabled = enable;
+    w->pacing.spin_ns = spin_ns;
 
-    return padding_bytes;
+    return 0;
 }
 
-void write_bytes( bs_t *s, uint8_t *bytes, int length )
+int ts_set_scheduler( ts_writer_t *w, int scheduler )
 {
-    bs_flush( s );
-    uint8_t *p_start = s->p_start;
+    if( scheduler < LIBMPEGTS_SCHEDULER_DEFAULT || scheduler > LIBMPEGTS_SCHEDULER_EDF )
+    {
+        fprintf( stderr, "Invalid scheduler\n" );
+        return -1;
+    }
 
-    memcpy( s->p, bytes, length );
-    s->p += length;
+    w->scheduler = scheduler;
 
-    bs_init( s, s->p, s->p_end - s->p );
-    s->p_start = p_start;
+    return 0;
 }
 
-/**** Descriptors ****/
-/* Registration Descriptor */
-void write_registration_descriptor( bs_t *s, int descriptor_tag, int descriptor_length, char *format_id )
+int ts_set_stream_max_delay( ts_writer_t *w, int pid, int64_t max_delay )
 {
-    bs_write( s, 8, descriptor_tag );    // descriptor_tag
-    bs_write( s, 8, descriptor_length ); // descriptor_length
-    while( *format_id != '\0' )
-        bs_write( s, 8, *format_id++ );  // format_identifier
-}
+    ts_int_stream_t *stream = find_stream( w, pid );
 
-/* First loop of PMT Descriptors */
-static void write_smoothing_buffer_descriptor( bs_t *s, ts_int_program_t *program )
-{
-    bs_write( s, 8, SMOOTHING_BUFFER_DESCRIPTOR_TAG ); // descriptor_tag
-    bs_write( s, 8, 0x4 );                    // descriptor_length
+    if( !stream )
+    {
+        fprintf( stderr, "Invalid PID\n" );
+        return -1;
+    }
 
-    bs_write( s, 2, 0x3 );                    // reserved
-    bs_write( s, 22, program->sb_leak_rate ); // sb_leak_rate
-    bs_write( s, 2, 0x3 );                    // reserved
-    bs_write( s, 22, program->sb_size );      // sb_size
+    if( max_delay < 0 || max_delay > INT64_MAX / 300 )
+    {
+        fprintf( stderr, "Invalid maximum delay\n" );
+        return -1;
+    }
+
+    stream->max_delay = max_delay * 300;
+
+    return 0;
 }
 
-/* Second loop of PMT Descriptors */
-#if 0
-static void write_video_stream_descriptor( bs_t *s, ts_int_stream_t *stream )
+int ts_set_diag_callback( ts_writer_t *w, void (*diag)( void *opaque, ts_diag_t *diag ), void *opaque, int64_t interval )
 {
-    bs_write( s, 8, VIDEO_STREAM_DESCRIPTOR_TAG ); // descriptor_tag
-    bs_write( s, 8, 0x04 );                        // descriptor_length
+    if( interval < 0 )
+    {
+        fprintf( stderr, "Invalid diagnostic interval\n" );
+        return -1;
+    }
 
-    bs_write1( s, 0 );   // multiple_frame_rate_flag
-    bs_write( s, 4, 0 ); // frame_rate_code FIXME
-    bs_write1( s, 0 );   // MPEG_1_only_flag
-    bs_write1( s, 0 );   // constrained_parameter_flag
-    bs_write1( s, 0 );   // still_picture_flag
-    bs_write( s, 8, 0 ); // profile_and_level_indication FIXME
-    bs_write( s, 2, 0 ); // chroma_format FIXME
-    bs_write1( s, 0 );   // frame_rate_extension_flag FIXME
-    bs_write( s, 5, 0x1f ); // reserved
+    w->diag.callback = diag ? diag : print_diag;
+    w->diag.opaque = diag ? opaque : NULL;
+    w->diag.interval = interval;
+
+    return 0;
 }
-#endif
-static void write_avc_descriptor( bs_t *s, ts_int_stream_t *stream )
+
+/* Count the event and pass it on unless it was reported less than an interval ago.
+ * This is called for every late packet so it must stay cheap. */
+static void report_diag( ts_writer_t *w, int code, ts_int_pes_t *pes )
 {
-    bs_write( s, 8, AVC_DESCRIPTOR_TAG ); // descriptor_tag
-    bs_write( s, 8, 0x04 );               // descriptor_length
+    w->diag.total[code]++;
+    w->diag.pending[code]++;
 
-    bs_write( s, 8, avc_profiles[stream->mpegvideo_ctx->profile] ); // profile_idc
+    if( w->diag.total[code] > 1 && w->cur_pcr - w->diag.last_report[code] < w->diag.interval )
+        return;
 
-    bs_write1( s, stream->mpegvideo_ctx->profile == AVC_BASELINE ); // constraint_set0_flag
-    bs_write1( s, stream->mpegvideo_ctx->profile <= AVC_MAIN );     // constraint_set1_flag
-    bs_write1( s, 0 );                                              // constraint_set2_flag
-        if( stream->mpegvideo_ctx->level == 9 && stream->mpegvideo_ctx->profile <= AVC_MAIN ) // level 1b
-            bs_write1( s, 1 );                                           // constraint_set3_flag
-        else if( stream->mpegvideo_ctx->profile == AVC_HIGH_10_INTRA   ||
-                 stream->mpegvideo_ctx->profile == AVC_CAVLC_444_INTRA ||
-                 stream->mpegvideo_ctx->profile == AVC_HIGH_444_INTRA )
-            bs_write1( s, 1 );                                       // constraint_set3_flag
-        else
-            bs_write1( s, 0 );                                       // constraint_set3_flag
-    bs_write1( s, 0 );                                               // constraint_set4_flag
-    bs_write1( s, 0 );                                               // constraint_set5_flag
+    ts_diag_t diag =
+    {
+        .code = code,
+        .pid = pes->stream->pid,
+        .dts = pes->dts,
+        .pts = pes->pts,
+        .pcr = w->cur_pcr,
+        .count = w->diag.pending[code],
+        .total = w->diag.total[code],
+    };
+
+    w->diag.pending[code] = 0;
+    w->diag.last_report[code] = w->cur_pcr;
+    w->diag.callback( w->diag.opaque, &diag );
+}
 
-    bs_write( s, 2, 0 );    // reserved
-    bs_write( s, 8, stream->mpegvideo_ctx->level & 0xff ); // level_idc
-    bs_write( s, 1, 0 );    // AVC_still_present
-    bs_write( s, 1, 0 );    // AVC_24_hour_picture_flag
-    bs_write( s, 6, 0x3f ); // reserved
+static void print_diag( void *opaque, ts_diag_t *diag )
+{
+    if( diag->code == LIBMPEGTS_DIAG_DTS_BEFORE_PCR )
+        fprintf( stderr, "dts is less than pcr pid: %i dts: %f pcr: %f (%"PRId64" packets)\n", diag->pid,
+                 (double)diag->dts/90000, (double)diag->pcr/TS_CLOCK, diag->count );
+    else if( diag->code == LIBMPEGTS_DIAG_DTS_AFTER_PTS )
+        fprintf( stderr, "Error: DTS > PTS pid: %i dts: %f pts: %f (%"PRId64" frames)\n", diag->pid,
+                 (double)diag->dts/90000, (double)diag->pts/90000, diag->count );
+    else if( diag->code == LIBMPEGTS_DIAG_MAX_DELAY )
+        fprintf( stderr, "Maximum delay exceeded pid: %i dts: %f pcr: %f (%"PRId64" frames)\n", diag->pid,
+                 (double)diag->dts/90000, (double)diag->pcr/TS_CLOCK, diag->count );
 }
 
-static void write_data_stream_alignment_descriptor( bs_t *s )
+void ts_get_pacing_stats( ts_writer_t *w, ts_pacing_stats_t *stats )
 {
-    bs_write( s, 8, DATA_STREAM_ALIGNMENT_DESCRIPTOR_TAG ); // descriptor_tag
-    bs_write( s, 8, 1 );               // descriptor_length
-    bs_write( s, 8, 1 );               // alignment_type
+    memset( stats, 0, sizeof(*stats) );
+    stats->num_bursts = w->pacing.num_bursts;
+    stats->mean_offset = w->pacing.num_bursts ? w->pacing.sum_offset / w->pacing.num_bursts : 0;
+    stats->max_offset = w->pacing.max_offset;
+    stats->max_jitter = w->pacing.max_jitter;
 }
 
-/* AC-3 Descriptor for DVB and Blu-Ray */
-static void write_ac3_descriptor( ts_writer_t *w, bs_t *s, int e_ac3 )
+int ts_set_null_deletion( ts_writer_t *w, int enable )
 {
-    if( w->ts_type == TS_TYPE_BLU_RAY )
-        bs_write( s, 8, HDMV_AC3_DESCRIPTOR_TAG ); // descriptor_tag
-    else if( e_ac3 )
-        bs_write( s, 8, DVB_EAC3_DESCRIPTOR_TAG ); // descriptor_tag
-    else
-        bs_write( s, 8, DVB_AC3_DESCRIPTOR_TAG );  // descriptor_tag
+    if( enable && (!w->cbr || w->ts_type == TS_TYPE_BLU_RAY) )
+    {
+        fprintf( stderr, "Null packet deletion needs a CBR stream other than Blu-ray\n" );
+        return -1;
+    }
 
-    bs_write( s, 8, 1 );        // descriptor_length
+    if( w->num_cur_pes )
+    {
+        fprintf( stderr, "Output is pending. Call ts_write_frames without frames until it is complete\n" );
+        return -1;
+    }
 
-    bs_write1( s, 0 );          // component_type_flag
-    bs_write1( s, 0 );          // bsid_flag
-    bs_write1( s, 0 );          // mainid_flag
-    bs_write1( s, 0 );          // asvc_flag
+    w->out.null_deletion = !!enable;
+    w->out.deleted_nulls = 0;
 
-    if( e_ac3 )
+    return 0;
+}
+
+int ts_write_fd_sink( void *opaque, uint8_t *data, int len )
+{
+    int fd = *(int*)opaque;
+    int written = 0;
+
+    while( written < len )
     {
-        bs_write1( s, 0 );      // mixinfoexists
-        bs_write1( s, 0 );      // substream1_flag
-        bs_write1( s, 0 );      // substream2_flag
-        bs_write1( s, 0 );      // substream3_flag
+        ssize_t ret = write( fd, data + written, len - written );
+        if( ret < 0 )
+        {
+            if( errno == EINTR )
+                continue;
+            break;
+        }
+        written += ret;
     }
-    else
-        bs_write( s, 4, 0 );    // reserved
+
+    return written;
 }
 
-static void write_iso_lang_descriptor( bs_t *s, ts_int_stream_t *stream )
+int ts_write_memory_sink( void *opaque, uint8_t *data, int len )
 {
-    bs_write( s, 8, ISO_693_LANGUAGE_DESCRIPTOR_TAG ); // descriptor_tag
-    bs_write( s, 8, 0x4 ); // descriptor_length
-    for( int i = 0; i < 3; i++ )
-        bs_write( s, 8, stream->lang_code[i] );
+    ts_memory_sink_t *sink = opaque;
 
-    bs_write(s, 8, stream->audio_type ); // audio_type
+    if( sink->len + len > sink->size )
+    {
+        int size = sink->size ? sink->size : 65536;
+        while( size < sink->len + len )
+            size *= 2;
+
+        uint8_t *buf = realloc( sink->data, size );
+        if( !buf )
+            return -1;
+        sink->data = buf;
+        sink->size = size;
+    }
+
+    memcpy( sink->data + sink->len, data, len );
+    sink->len += len;
+
+    return len;
 }
 
-/**** PCR functions ****/
-static int check_pcr( ts_writer_t *w, ts_int_program_t *program )
+int ts_set_zero_copy( ts_writer_t *w, void (*release_frame)( void *opaque, uint8_t *data ), void *opaque )
 {
-    // if the next packet written goes over the max pcr retransmit boundary, write the pcr in the next packet
-    double next_pkt_pcr = program->cur_pcr + (TS_PACKET_SIZE + 7) * 8.0 / w->ts_muxrate - (double)program->last_pcr / TS_CLOCK;
-    if( next_pkt_pcr >= (double)w->pcr_period / 1000 )
+    if( w->num_buffered_frames )
     {
-        return 1;
+        fprintf( stderr, "Zero-copy mode cannot be changed while frames are buffered\n" );
+        return -1;
     }
 
+    w->release_frame = release_frame;
+    w->release_opaque = opaque;
+
     return 0;
 }
 
-void increase_pcr( ts_writer_t *w, int num_packets )
+void ts_get_pool_stats( ts_writer_t *w, ts_pool_stats_t *stats )
 {
-    // TODO do this for all programs
-    ts_int_program_t *program = w->programs[0];
-    double next_pcr = program->cur_pcr + (8.0 * num_packets * TS_PACKET_SIZE / w->ts_muxrate);
+    memset( stats, 0, sizeof(*stats) );
+    stats->num_allocs = w->pool_allocs;
+    stats->num_reuses = w->pool_reuses;
 
-    /* buffer drip (TODO: all buffers) */
-    drip_buffer( program, w->rx_sys, &w->tb, next_pcr );
-    for( int i = 0; i < program->num_streams; i++ )
+    for( int i = 0; i < w->num_programs; i++ )
     {
-        drip_buffer( program, program->streams[i]->rx, &program->streams[i]->tb, next_pcr );
+        for( int j = 0; j < w->programs[i]->num_streams; j++ )
+        {
+            ts_int_stream_t *stream = w->programs[i]->streams[j];
+            stats->num_allocs += stream->pool_allocs;
+            stats->num_reuses += stream->pool_reuses;
+            for( ts_int_pes_t *pes = stream->pes_pool; pes; pes = pes->next )
+                stats->pooled_bytes += sizeof(*pes) + pes->data_size;
+        }
     }
-
-    program->cur_pcr += 8.0 * num_packets * TS_PACKET_SIZE / w->ts_muxrate;
 }
 
-/**** Buffer management ****/
-static void add_to_buffer( buffer_t *buffer )
+int ts_get_stats( ts_writer_t *w, ts_stats_t *stats, ts_pid_stats_t *pids, int max_pids )
 {
-    buffer->cur_buf += TS_PACKET_SIZE * 8;
-}
+    memset( stats, 0, sizeof(*stats) );
+    stats->null_packets = w->pid_packets[NULL_PID & 0x1fff];
+    stats->psi_packets = w->psi_packets;
+    stats->pcr_packets = w->pcr_packets;
+    stats->deleted_packets = w->deleted_packets;
+    memcpy( stats->diag_events, w->diag.total, sizeof(stats->diag_events) );
+
+    for( int pid = 0; pid < MAX_PIDS; pid++ )
+    {
+        if( !w->pid_packets[pid] )
+            continue;
 
-static void drip_buffer( ts_int_program_t *program, int rx, buffer_t *buffer, double next_pcr )
-{
-    if( buffer->last_byte_removal_time == 0.0 )
+        stats->packets += w->pid_packets[pid];
+        if( stats->num_pids < max_pids && pids )
+        {
+            ts_pid_stats_t *p = &pids[stats->num_pids];
+            ts_int_stream_t *stream = w->pid_map[pid];
+
+            memset( p, 0, sizeof(*p) );
+            p->pid = pid;
+            p->packets = w->pid_packets[pid];
+            p->bytes = (p->packets - (pid == (NULL_PID & 0x1fff) ? w->deleted_packets : 0)) * packet_size( w );
+            if( stream )
+            {
+                p->tb_max = stream->tb.max_buf >> 3;
+                p->tb_size = stream->tb.buf_size >> 3;
+            }
+
+            for( int i = 0; i < w->num_programs; i++ )
+            {
+                ts_int_program_t *program = w->programs[i];
+                if( program->pcr_stream && program->pcr_stream->pid == pid )
+                {
+                    p->min_pcr_interval = program->min_pcr_interval;
+                    p->max_pcr_interval = program->max_pcr_interval;
+                }
+            }
+        }
+        stats->num_pids++;
+    }
+
+    for( int i = 0; i < w->num_programs; i++ )
     {
-        buffer->last_byte_removal_time = program->cur_pcr;
-        buffer->cur_buf -= 8;
+        ts_int_program_t *program = w->programs[i];
+        if( program->num_pcrs < 2 )
+            continue;
+        if( !stats->min_pcr_interval || program->min_pcr_interval < stats->min_pcr_interval )
+            stats->min_pcr_interval = program->min_pcr_interval;
+        stats->max_pcr_interval = MAX( stats->max_pcr_interval, program->max_pcr_interval );
     }
 
-    while( buffer->last_byte_removal_time + (8.0 / rx) < next_pcr )
+    if( stats->packets )
     {
-        buffer->cur_buf -= 8;
-        buffer->last_byte_removal_time += 8.0 / rx;
+        stats->stuffing_ratio = (double)stats->null_packets / stats->packets;
+        stats->psi_overhead = (double)stats->psi_packets / stats->packets;
     }
 
-    buffer->cur_buf = MAX( buffer->cur_buf, 0 );
+    return 0;
 }
 
-static void retransmit_psi_and_si( ts_writer_t *w, ts_int_program_t *program, int first )
+int ts_get_profile( ts_writer_t *w, ts_profile_t *phases, int max_phases )
 {
-    // TODO make this work with multiple programs
-    if( (uint64_t)(program->cur_pcr * TS_CLOCK) - w->last_pat >= w->pat_period * 27000LL || first )
+#if HAVE_PROFILE
+    int num = MIN( max_phases, PROFILE_COUNT );
+
+    for( int i = 0; i < num; i++ )
     {
-        w->last_pat = (uint64_t)(program->cur_pcr * 27000000LL);
-        write_pat( w );
-        write_pmt( w, program );
+        phases[i].name = profile_names[i];
+        phases[i].calls = w->profile[i].calls;
+        phases[i].ticks = w->profile[i].ticks;
     }
 
+    return num;
+#else
+    fprintf( stderr, "libmpegts was built without profiling\n" );
+    return -1;
+#endif
 }
 
-static int write_adaptation_field( ts_writer_t *w, bs_t *s, ts_int_program_t *program, ts_int_pes_t *pes,
-                                   int write_pcr, int flags, int stuffing, int discontinuity )
+void ts_reset_profile( ts_writer_t *w )
 {
-    int private_data_flag, write_dvb_au, random_access, priority;
-    int start = bs_pos( s );
-    uint8_t temp[512], temp2[256];
-    bs_t q, r;
+#if HAVE_PROFILE
+    memset( w->profile, 0, sizeof(w->profile) );
+#endif
+}
 
-    private_data_flag = write_dvb_au = random_access = priority = 0;
+int ts_set_threads( ts_writer_t *w, int threads )
+{
+#if HAVE_PTHREAD
+    stop_threads( w );
 
-    if( pes && (pes->data == pes->cur_pos) )
-    {
-        ts_int_stream_t *stream = pes->stream;
-        random_access = pes->random_access;
-        priority = pes->priority;
-        pes->random_access = 0; /* don't write this flag again */
+    if( threads <= 1 )
+        return 0;
 
-        if( stream->dvb_au && ( stream->stream_format == LIBMPEGTS_VIDEO_MPEG2 || stream->stream_format == LIBMPEGTS_VIDEO_AVC ) )
-            private_data_flag = write_dvb_au = 1;
+    /* the calling thread builds pes too */
+    w->threads = calloc( threads - 1, sizeof(*w->threads) );
+    if( !w->threads )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        return -1;
     }
 
-    /* initialise temporary bitstream */
-    bs_init( &q, temp, 256 );
+    pthread_mutex_init( &w->thread_mutex, NULL );
+    pthread_cond_init( &w->job_cond, NULL );
+    pthread_cond_init( &w->done_cond, NULL );
+    w->thread_exit = 0;
 
-    if( flags )
+    for( int i = 0; i < threads - 1; i++ )
     {
-        bs_write1( &q, discontinuity ); // discontinuity_indicator
-        bs_write1( &q, random_access ); // random_access_indicator
-        bs_write1( &q, priority );  // elementary_stream_priority_indicator
-        bs_write1( &q, write_pcr ); // PCR_flag
-        bs_write1( &q, 0 ); // OPCR_flag
-        bs_write1( &q, 0 ); // splicing_point_flag
-        bs_write1( &q, private_data_flag ); // transport_private_data_flag
-        bs_write1( &q, 0 ); // adaptation_field_extension_flag
-        if( write_pcr )
+        if( pthread_create( &w->threads[i], NULL, build_thread, w ) )
         {
-             uint64_t pcr, base, extension;
-             int64_t mod = (int64_t)1 << 33;
-
-             program->last_pcr = pcr = program->cur_pcr * TS_CLOCK;
-             pcr += TS_CLOCK * 7.0 * 8.0 / w->ts_muxrate;
-
-             base = (pcr / 300) % mod;
-             extension = pcr % 300;
-
-             // program_clock_reference_base
-             bs_write32( &q, base >> 1 );
-             bs_write1( &q, (base & 1) );
-             // reserved
-             bs_write( &q, 6, 0x3f );
-             // program_clock_reference_extension
-             bs_write( &q, 8, (extension >> 1) & 0xff );
-             bs_write1( &q, (extension & 1 ) );
+            fprintf( stderr, "Could not create thread\n" );
+            w->num_threads = i + 1;
+            stop_threads( w );
+            return -1;
         }
     }
+    w->num_threads = threads;
 
-    if( private_data_flag )
+    return 0;
+#else
+    if( threads > 1 )
     {
-        /* initialise another temporary bitstream */
-        bs_init( &r, temp2, 128 );
+        fprintf( stderr, "libmpegts was built without thread support\n" );
+        return -1;
+    }
+
+    return 0;
+#endif
+}
+
+int ts_set_pipeline( ts_writer_t *w, int queue_size )
+{
+    stop_pipeline( w );
+
+    if( queue_size <= 0 )
+        return 0;
+
+    /* one more entry for the end of a call of ts_queue_frames */
+    if( ring_init( &w->ready_pes, queue_size + 1 ) < 0 || ring_init( &w->done_pes, queue_size ) < 0 )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        free( w->ready_pes.pes );
+        free( w->done_pes.pes );
+        memset( &w->ready_pes, 0, sizeof(w->ready_pes) );
+        memset( &w->done_pes, 0, sizeof(w->done_pes) );
+        return -1;
+    }
+    w->pipeline = 1;
+
+    return 0;
+}
+
+int ts_queue_frames( ts_writer_t *w, ts_frame_t *frames, int num_frames )
+{
+    if( !w->pipeline )
+    {
+        fprintf( stderr, "Pipelined packetization is not enabled. Call ts_set_pipeline\n" );
+        return -1;
+    }
+
+    if( num_frames < 0 )
+    {
+        fprintf( stderr, "Invalid number of frames\n" );
+        return -1;
+    }
+
+    /* one entry marks the end of the frames */
+    if( num_frames >= w->ready_pes.mask + 1 )
+    {
+        fprintf( stderr, "More frames than the size of the pipeline queue\n" );
+        return -1;
+    }
+
+    /* reuse the pes written since the last call */
+    take_done_pes( w );
+
+    /* the frames are passed to ts_write_frames as a whole */
+    if( num_frames >= ring_space( &w->ready_pes ) )
+        return 0;
+
+    int num_built = prepare_frames( w, frames, num_frames );
+    ring_push( &w->ready_pes, w->frame_pes, num_built, 1 );
+
+    return num_built < num_frames ? -1 : 1;
+}
+
+int ts_delete_stream( ts_writer_t *w, int pid )
+{
+    ts_int_stream_t *stream = find_stream( w, pid );
+    ts_int_program_t *program;
+
+    if( !stream )
+    {
+        fprintf( stderr, "PID %i not found\n", pid );
+        return -1;
+    }
+
+    program = stream->program;
+
+    if( stream == program->pcr_stream )
+    {
+        fprintf( stderr, "The PCR stream cannot be deleted\n" );
+        return -1;
+    }
+
+    if( w->num_cur_pes )
+    {
+        fprintf( stderr, "Streams cannot be deleted while output is pending\n" );
+        return -1;
+    }
+
+    /* the queues of the pipeline belong to the threads calling ts_queue_frames and ts_write_frames */
+    if( w->pipeline )
+    {
+        fprintf( stderr, "Streams cannot be deleted while the pipeline is enabled\n" );
+        return -1;
+    }
+
+    /* the PMT is rebuilt without the stream */
+    invalidate_pmt( w, stream );
+
+    /* frames which were never written. The scheduling heap is rebuilt by the next call of ts_write_frames */
+    while( stream->pes_head )
+    {
+        ts_int_pes_t *next = stream->pes_head->next;
+        free_pes( w, stream->pes_head );
+        stream->pes_head = next;
+        w->num_buffered_frames--;
+    }
+    free_pes_pool( stream );
+    w->pool_allocs += stream->pool_allocs;
+    w->pool_reuses += stream->pool_reuses;
+
+    for( int i = 0; i < program->num_streams; i++ )
+    {
+        if( program->streams[i] == stream )
+        {
+            memmove( &program->streams[i], &program->streams[i+1], (program->num_streams - i - 1) * sizeof(*program->streams) );
+            program->num_streams--;
+            break;
+        }
+    }
+
+    if( program->video_stream == stream )
+        program->video_stream = NULL;
+    w->pid_map[pid] = NULL;
+
+    if( stream->mpegvideo_ctx )
+        free( stream->mpegvideo_ctx );
+    if( stream->lpcm_ctx )
+        free( stream->lpcm_ctx );
+    if( stream->atsc_ac3_ctx )
+        free( stream->atsc_ac3_ctx );
+    if( stream->dvb_sub_ctx )
+        free( stream->dvb_sub_ctx );
+    free( stream );
+
+    return 0;
+}
+
+int ts_close_writer( ts_writer_t *w )
+{
+    stop_pipeline( w );
+
+    for( int i = 0; i < w->num_programs; i++ )
+    {
+        /* a PCR stream without elementary stream data of its own */
+        ts_int_stream_t *pcr_stream = w->programs[i]->pcr_stream;
+        int separate_pcr_stream = pcr_stream && w->pid_map[pcr_stream->pid] != pcr_stream;
+
+        for( int j = 0; j < w->programs[i]->num_streams; j++ )
+        {
+            /* frames which were never written */
+            ts_int_pes_t *pes = w->programs[i]->streams[j]->pes_head;
+            while( pes )
+            {
+                ts_int_pes_t *next = pes->next;
+                free_pes( w, pes );
+                pes = next;
+            }
+            free_pes_pool( w->programs[i]->streams[j] );
+
+            // TODO free other stuff
+            if( w->programs[i]->streams[j]->mpegvideo_ctx )
+                free( w->programs[i]->streams[j]->mpegvideo_ctx );
+            if( w->programs[i]->streams[j]->lpcm_ctx )
+                free( w->programs[i]->streams[j]->lpcm_ctx );
+            if( w->programs[i]->streams[j]->atsc_ac3_ctx )
+                free( w->programs[i]->streams[j]->atsc_ac3_ctx );
+            if( w->programs[i]->streams[j]->dvb_sub_ctx )
+                free( w->programs[i]->streams[j]->dvb_sub_ctx );
+            free( w->programs[i]->streams[j] );
+        }
+
+        if( separate_pcr_stream )
+            free( pcr_stream );
+        free( w->programs[i] );
+    }
+
+    stop_threads( w );
+    free( w->frame_pes );
+
+    if( w->out.p_bitstream && !w->out.user_buffer )
+        free( w->out.p_bitstream );
+    free( w );
+
+    return 0;
+}
+
+void write_packet_header( ts_writer_t *w, int start, int pid, int adapt_field, int *cc )
+{
+    bs_t *s = &w->out.bs;
+    int cur_cc = adapt_field == ADAPT_FIELD_ONLY ? *cc - 1 : (*cc)++;
+
+    w->pid_packets[pid & 0x1fff]++;
+
+    /* packets always start on a byte boundary so the header is stored directly */
+    bs_flush_bytes( s );
+    write_deleted_count( w );
+
+    if( w->ts_type == TS_TYPE_BLU_RAY )
+    {
+        // tp_extra_header: copy_permission_indicator and arrival_time_stamp FIXME
+        M32( s->p ) = 0;
+        s->p += 4;
+    }
+
+    M32( s->p ) = endian_fix32( 0x47 << 24 |                 // sync byte, transport_error_indicator
+                                start << 22 |                // payload_unit_start_indicator, transport_priority
+                                (pid & 0x1fff) << 8 |        // PID, transport_scrambling_control
+                                (adapt_field & 0x03) << 4 |  // adaptation_field_control
+                                (cur_cc & 0xf) );            // continuity counter
+    s->p += 4;
+}
+
+/* Padding and payload bytes are byte-aligned so they are stored directly rather than through
+ * the bit writer. After bs_flush_bytes the bitstream can be written to at any byte position. */
+int write_padding( bs_t *s, int start )
+{
+    bs_flush_bytes( s );
+    int padding_bytes = TS_PACKET_SIZE - (bs_pos( s ) - start) / 8;
+
+    memset( s->p, 0xff, padding_bytes );
+    s->p += padding_bytes;
+
+    return padding_bytes;
+}
+
+void write_bytes( bs_t *s, uint8_t *bytes, int length )
+{
+    bs_flush_bytes( s );
+
+    memcpy( s->p, bytes, length );
+    s->p += length;
+}
+
+/**** Descriptors ****/
+/* Registration Descriptor */
+void write_registration_descriptor( bs_t *s, int descriptor_tag, int descriptor_length, char *format_id )
+{
+    bs_write( s, 8, descriptor_tag );    // descriptor_tag
+    bs_write( s, 8, descriptor_length ); // descriptor_length
+    while( *format_id != '\0' )
+        bs_write( s, 8, *format_id++ );  // format_identifier
+}
+
+/* First loop of PMT Descriptors */
+static void write_smoothing_buffer_descriptor( bs_t *s, ts_int_program_t *program )
+{
+    bs_write( s, 8, SMOOTHING_BUFFER_DESCRIPTOR_TAG ); // descriptor_tag
+    bs_write( s, 8, 0x4 );                    // descriptor_length
+
+    bs_write( s, 2, 0x3 );                    // reserved
+    bs_write( s, 22, program->sb_leak_rate ); // sb_leak_rate
+    bs_write( s, 2, 0x3 );                    // reserved
+    bs_write( s, 22, program->sb_size );      // sb_size
+}
+
+/* Second loop of PMT Descriptors */
+#if 0
+static void write_video_stream_descriptor( bs_t *s, ts_int_stream_t *stream )
+{
+    bs_write( s, 8, VIDEO_STREAM_DESCRIPTOR_TAG ); // descriptor_tag
+    bs_write( s, 8, 0x04 );                        // descriptor_length
+
+    bs_write1( s, 0 );   // multiple_frame_rate_flag
+    bs_write( s, 4, 0 ); // frame_rate_code FIXME
+    bs_write1( s, 0 );   // MPEG_1_only_flag
+    bs_write1( s, 0 );   // constrained_parameter_flag
+    bs_write1( s, 0 );   // still_picture_flag
+    bs_write( s, 8, 0 ); // profile_and_level_indication FIXME
+    bs_write( s, 2, 0 ); // chroma_format FIXME
+    bs_write1( s, 0 );   // frame_rate_extension_flag FIXME
+    bs_write( s, 5, 0x1f ); // reserved
+}
+#endif
+static void write_avc_descriptor( bs_t *s, ts_int_stream_t *stream )
+{
+    bs_write( s, 8, AVC_DESCRIPTOR_TAG ); // descriptor_tag
+    bs_write( s, 8, 0x04 );               // descriptor_length
+
+    bs_write( s, 8, avc_profiles[stream->mpegvideo_ctx->profile] ); // profile_idc
+
+    bs_write1( s, stream->mpegvideo_ctx->profile == AVC_BASELINE ); // constraint_set0_flag
+    bs_write1( s, stream->mpegvideo_ctx->profile <= AVC_MAIN );     // constraint_set1_flag
+    bs_write1( s, 0 );                                              // constraint_set2_flag
+        if( stream->mpegvideo_ctx->level == 9 && stream->mpegvideo_ctx->profile <= AVC_MAIN ) // level 1b
+            bs_write1( s, 1 );                                           // constraint_set3_flag
+        else if( stream->mpegvideo_ctx->profile == AVC_HIGH_10_INTRA   ||
+                 stream->mpegvideo_ctx->profile == AVC_CAVLC_444_INTRA ||
+                 stream->mpegvideo_ctx->profile == AVC_HIGH_444_INTRA )
+            bs_write1( s, 1 );                                       // constraint_set3_flag
+        else
+            bs_write1( s, 0 );                                       // constraint_set3_flag
+    bs_write1( s, 0 );                                               // constraint_set4_flag
+    bs_write1( s, 0 );                                               // constraint_set5_flag
+
+    bs_write( s, 2, 0 );    // reserved
+    bs_write( s, 8, stream->mpegvideo_ctx->level & 0xff ); // level_idc
+    bs_write( s, 1, 0 );    // AVC_still_present
+    bs_write( s, 1, 0 );    // AVC_24_hour_picture_flag
+    bs_write( s, 6, 0x3f ); // reserved
+}
+
+static void write_data_stream_alignment_descriptor( bs_t *s )
+{
+    bs_write( s, 8, DATA_STREAM_ALIGNMENT_DESCRIPTOR_TAG ); // descriptor_tag
+    bs_write( s, 8, 1 );               // descriptor_length
+    bs_write( s, 8, 1 );               // alignment_type
+}
+
+/* AC-3 Descriptor for DVB and Blu-Ray */
+static void write_ac3_descriptor( ts_writer_t *w, bs_t *s, int e_ac3 )
+{
+    if( w->ts_type == TS_TYPE_BLU_RAY )
+        bs_write( s, 8, HDMV_AC3_DESCRIPTOR_TAG ); // descriptor_tag
+    else if( e_ac3 )
+        bs_write( s, 8, DVB_EAC3_DESCRIPTOR_TAG ); // descriptor_tag
+    else
+        bs_write( s, 8, DVB_AC3_DESCRIPTOR_TAG );  // descriptor_tag
+
+    bs_write( s, 8, 1 );        // descriptor_length
+
+    bs_write1( s, 0 );          // component_type_flag
+    bs_write1( s, 0 );          // bsid_flag
+    bs_write1( s, 0 );          // mainid_flag
+    bs_write1( s, 0 );          // asvc_flag
+
+    if( e_ac3 )
+    {
+        bs_write1( s, 0 );      // mixinfoexists
+        bs_write1( s, 0 );      // substream1_flag
+        bs_write1( s, 0 );      // substream2_flag
+        bs_write1( s, 0 );      // substream3_flag
+    }
+    else
+        bs_write( s, 4, 0 );    // reserved
+}
+
+static void write_iso_lang_descriptor( bs_t *s, ts_int_stream_t *stream )
+{
+    bs_write( s, 8, ISO_693_LANGUAGE_DESCRIPTOR_TAG ); // descriptor_tag
+    bs_write( s, 8, 0x4 ); // descriptor_length
+    for( int i = 0; i < 3; i++ )
+        bs_write( s, 8, stream->lang_code[i] );
+
+    bs_write(s, 8, stream->audio_type ); // audio_type
+}
+
+/**** PCR functions ****/
+static int check_pcr( ts_writer_t *w, ts_int_program_t *program )
+{
+    // if the next packet written goes over the max pcr retransmit boundary, write the pcr in the next packet
+    /* time since the last pcr in units of 1/ts_muxrate ticks */
+    int64_t next_pkt_pcr = (w->cur_pcr - (int64_t)program->last_pcr) * w->ts_muxrate + w->cur_pcr_rem + pcr_margin( w );
+    if( next_pkt_pcr >= w->pcr_period * 27000LL * w->ts_muxrate )
+    {
+        return 1;
+    }
+
+    return 0;
+}
+
+/* How far ahead check_pcr looks, in units of 1/ts_muxrate ticks: up to the PCR field of the next packet.
+ * PCRs which fall due together go out one after another, so with several programs a PCR which is not due
+ * yet may wait for a full burst of the others, the next packet and most of another burst */
+static int64_t pcr_margin( ts_writer_t *w )
+{
+    return ((2 * w->num_programs - 1) * TS_PACKET_SIZE + 7) * 8LL * TS_CLOCK;
+}
+
+/* Write a PCR-only packet for each program apart from except whose PCR is due.
+ * Returns the number of packets written */
+static int write_pcrs( ts_writer_t *w, ts_int_program_t *except )
+{
+    int num_written = 0;
+
+    for( int i = 0; i < w->num_programs; i++ )
+    {
+        if( w->programs[i] != except && check_pcr( w, w->programs[i] ) )
+        {
+            write_pcr_empty( w, w->programs[i], 0 );
+            num_written++;
+        }
+    }
+
+    return num_written;
+}
+
+void increase_pcr( ts_writer_t *w, int num_packets )
+{
+    PROFILE_START( w, PROFILE_TSTD );
+
+    /* each packet lasts exactly 8*188*TS_CLOCK/ts_muxrate ticks; carry the fraction of a tick in the remainder */
+    int64_t next_pcr_rem = w->cur_pcr_rem + (int64_t)num_packets * TS_PACKET_SIZE * 8 * TS_CLOCK;
+    int64_t next_pcr = w->cur_pcr + next_pcr_rem / w->ts_muxrate;
+    next_pcr_rem %= w->ts_muxrate;
+
+    /* buffer drip (TODO: all buffers) */
+    drip_buffer( w, w->rx_sys, &w->tb, next_pcr, next_pcr_rem );
+    for( int i = 0; i < w->num_programs; i++ )
+    {
+        ts_int_program_t *program = w->programs[i];
+        for( int j = 0; j < program->num_streams; j++ )
+            drip_buffer( w, program->streams[j]->rx, &program->streams[j]->tb, next_pcr, next_pcr_rem );
+    }
+
+    w->cur_pcr = next_pcr;
+    w->cur_pcr_rem = next_pcr_rem;
+
+    PROFILE_STOP( w, PROFILE_TSTD );
+}
+
+/**** Buffer management ****/
+static void add_to_buffer( buffer_t *buffer )
+{
+    buffer->cur_buf += TS_PACKET_SIZE * 8;
+    buffer->max_buf = MAX( buffer->max_buf, buffer->cur_buf );
+}
+
+static void drip_buffer( ts_writer_t *w, int rx, buffer_t *buffer, int64_t next_pcr, int64_t next_pcr_rem )
+{
+    if( buffer->last_byte_removal_time == 0 && buffer->last_byte_removal_rem == 0 )
+    {
+        buffer->last_byte_removal_time = w->cur_pcr;
+        buffer->last_byte_removal_rem = rx > 0 ? w->cur_pcr_rem * rx / w->ts_muxrate : 0;
+        buffer->cur_buf -= 8;
+    }
+
+    /* a buffer without a leak rate never drains */
+    if( rx <= 0 )
+    {
+        buffer->cur_buf = MAX( buffer->cur_buf, 0 );
+        return;
+    }
+
+    /* Leaky bucket: one byte leaves every 8/rx seconds, i.e. every 8*TS_CLOCK units of 1/rx ticks.
+     * Compute the number of whole bytes removed strictly before next_pcr in one go.
+     * elapsed is the time since the last removal in units of 1/rx ticks, rounded up. */
+    int64_t byte_time = 8 * TS_CLOCK;
+    int64_t frac = next_pcr_rem * rx;
+    int64_t elapsed = (next_pcr - buffer->last_byte_removal_time) * rx - buffer->last_byte_removal_rem +
+                      frac / w->ts_muxrate + !!(frac % w->ts_muxrate);
+    int64_t num_bytes = elapsed > 0 ? (elapsed - 1) / byte_time : 0;
+    int64_t removed = buffer->last_byte_removal_rem + num_bytes * byte_time;
+
+    buffer->last_byte_removal_time += removed / rx;
+    buffer->last_byte_removal_rem = removed % rx;
+    buffer->cur_buf = MAX( buffer->cur_buf - 8 * num_bytes, 0 );
+}
+
+static void retransmit_psi_and_si( ts_writer_t *w, int first )
+{
+    PROFILE_START( w, PROFILE_PSI );
+
+    /* every PMT goes out with each PAT */
+    if( w->cur_pcr - w->last_pat >= w->pat_period * 27000LL || first )
+    {
+        w->last_pat = w->cur_pcr;
+        write_pat( w );
+        for( int i = 0; i < w->num_programs; i++ )
+        {
+            /* don't let a PCR which falls due during the tables go out late */
+            write_pcrs( w, NULL );
+            write_pmt( w, w->programs[i] );
+        }
+    }
+
+    PROFILE_STOP( w, PROFILE_PSI );
+}
+
+/* Plan the adaptation field of the first packet of the pes. Whether the other packets need one only
+ * depends on the PCR being due and the payload left, which are known when each packet is written.
+ * The rest of the layout is not planned ahead: PCRs are inserted when they fall due, and the packets of a pes
+ * are interleaved with those of other PIDs by the scheduler, which only takes the pes again once its transport
+ * buffer is empty. A run of middle packets can therefore not be written in one go without running the same
+ * checks for each packet. Each middle packet is a header store and one copy of 184 bytes. */
+static void plan_pes( ts_int_pes_t *pes )
+{
+    ts_int_stream_t *stream = pes->stream;
+
+    pes->start_af_size = 0;
+
+    /* DVB AU_Information is large so consider this case */
+    // FIXME consider cablelabs legacy
+    if( stream->dvb_au )
+    {
+        pes->start_af_size = 2; /* adaptation_field_length and flags */
+
+        if( stream->stream_format == LIBMPEGTS_VIDEO_MPEG2 || stream->stream_format == LIBMPEGTS_VIDEO_AVC )
+        {
+            uint8_t temp[128];
+            bs_t r;
+
+            bs_init( &r, temp, 128 );
+            write_dvb_au_information( &r, pes );
+            bs_flush( &r );
+            pes->start_af_size += 1 + (bs_pos( &r ) >> 3); /* transport_private_data_length and data */
+        }
+    }
+}
+
+/* Size of the adaptation field of the next packet of the pes, before any stuffing */
+static int adaptation_field_size( ts_int_pes_t *pes, int pes_start, int write_pcr )
+{
+    int size = pes_start ? pes->start_af_size : 0;
+
+    if( write_pcr )
+        size = MAX( size, 2 ) + 6;
+
+    return size;
+}
+
+static int write_adaptation_field( ts_writer_t *w, bs_t *s, ts_int_program_t *program, ts_int_pes_t *pes,
+                                   int write_pcr, int flags, int stuffing, int discontinuity )
+{
+    int private_data_flag, write_dvb_au, random_access, priority;
+    int start = bs_pos( s );
+    uint8_t temp[512], temp2[256];
+    bs_t q, r;
+
+    PROFILE_START( w, PROFILE_ADAPT_FIELD );
+
+    private_data_flag = write_dvb_au = random_access = priority = 0;
+
+    if( pes && pes->bytes_left == pes->size )
+    {
+        ts_int_stream_t *stream = pes->stream;
+        random_access = pes->random_access;
+        priority = pes->priority;
+        pes->random_access = 0; /* don't write this flag again */
+
+        if( stream->dvb_au && ( stream->stream_format == LIBMPEGTS_VIDEO_MPEG2 || stream->stream_format == LIBMPEGTS_VIDEO_AVC ) )
+            private_data_flag = write_dvb_au = 1;
+    }
+
+    /* initialise temporary bitstream */
+    bs_init( &q, temp, 256 );
+
+    if( flags )
+    {
+        bs_write1( &q, discontinuity ); // discontinuity_indicator
+        bs_write1( &q, random_access ); // random_access_indicator
+        bs_write1( &q, priority );  // elementary_stream_priority_indicator
+        bs_write1( &q, write_pcr ); // PCR_flag
+        bs_write1( &q, 0 ); // OPCR_flag
+        bs_write1( &q, 0 ); // splicing_point_flag
+        bs_write1( &q, private_data_flag ); // transport_private_data_flag
+        bs_write1( &q, 0 ); // adaptation_field_extension_flag
+        if( write_pcr )
+        {
+             uint64_t pcr, base, extension;
+             int64_t mod = (int64_t)1 << 33;
+
+             int64_t interval = w->cur_pcr - program->prev_pcr;
+             if( program->num_pcrs++ )
+             {
+                 program->min_pcr_interval = program->num_pcrs > 2 ? MIN( program->min_pcr_interval, interval ) : interval;
+                 program->max_pcr_interval = MAX( program->max_pcr_interval, interval );
+             }
+             program->prev_pcr = w->cur_pcr;
+             program->last_pcr = w->cur_pcr;
+             /* the pcr refers to the byte containing its last bit, 7 bytes into the packet */
+             pcr = w->cur_pcr + (w->cur_pcr_rem + 7 * 8 * TS_CLOCK) / w->ts_muxrate;
+
+             base = (pcr / 300) % mod;
+             extension = pcr % 300;
+
+             // program_clock_reference_base
+             bs_write32( &q, base >> 1 );
+             bs_write1( &q, (base & 1) );
+             // reserved
+             bs_write( &q, 6, 0x3f );
+             // program_clock_reference_extension
+             bs_write( &q, 8, (extension >> 1) & 0xff );
+             bs_write1( &q, (extension & 1 ) );
+        }
+    }
+
+    if( private_data_flag )
+    {
+        /* initialise another temporary bitstream */
+        bs_init( &r, temp2, 128 );
+
+        if( write_dvb_au )
+            write_dvb_au_information( &r, pes );
+
+        bs_flush ( &r );
+        bs_write( &q, 8, bs_pos( &r ) >> 3 ); // transport_private_data_length
+        write_bytes( &q, temp2, bs_pos( &r ) >> 3 );
+    }
+
+    for( int i = 0; i < stuffing; i++ )
+        bs_write( &q, 8, 0xff );
+
+    bs_flush( &q );
+    bs_write( s, 8, bs_pos( &q ) >> 3 ); // adaptation_field_length
+    write_bytes( s, temp, bs_pos( &q ) >> 3 );
+
+    PROFILE_STOP( w, PROFILE_ADAPT_FIELD );
+
+    return (bs_pos( s ) - start) >> 3;
+}
+
+static void write_pcr_empty( ts_writer_t *w, ts_int_program_t *program, int first )
+{
+    bs_t *s = &w->out.bs;
+
+    write_packet_header( w, 0, program->pcr_stream->pid, ADAPT_FIELD_ONLY, &program->pcr_stream->cc );
+    int stuffing = 184 - 6 - 2; /* pcr, flags and length */
+    int discontinuity = first && w->ts_type == TS_TYPE_CABLELABS;
+    write_adaptation_field( w, s, program, NULL, 1, 1, stuffing, discontinuity );
+
+    add_to_buffer( &program->pcr_stream->tb );
+    increase_pcr( w, 1 );
+    w->pcr_packets++;
+}
+
+/**** PSI ****/
+/* Tables only change when the stream or program configuration does, so each one is built once
+ * and then copied into the output with its continuity_counter updated. */
+static void write_cached_packet( ts_writer_t *w, packet_cache_t *cache, int *cc )
+{
+    uint8_t *header = &cache->data[cache->size - TS_PACKET_SIZE];
+
+    header[3] = (header[3] & 0xf0) | ((*cc)++ & 0xf); // continuity counter
+    write_deleted_count( w );
+    write_bytes( &w->out.bs, cache->data, cache->size );
+
+    w->pid_packets[((header[1] & 0x1f) << 8) | header[2]]++;
+    w->psi_packets++;
+}
+
+/* Keep a copy of the packet written since byte position start, without the deleted null packet count */
+static void cache_packet( ts_writer_t *w, packet_cache_t *cache, int start )
+{
+    bs_t *s = &w->out.bs;
+
+    start += w->out.null_deletion;
+    cache->size = (bs_pos( s ) >> 3) - start;
+    memcpy( cache->data, s->p_start + start, cache->size );
+    w->psi_packets++;
+}
+
+void invalidate_pmt( ts_writer_t *w, ts_int_stream_t *stream )
+{
+    for( int i = 0; i < w->num_programs; i++ )
+    {
+        ts_int_program_t *program = w->programs[i];
+        for( int j = 0; j < program->num_streams; j++ )
+        {
+            /* only a table which has been transmitted gets a new version */
+            if( program->streams[j] == stream && program->pmt_cache.size )
+            {
+                program->pmt_cache.size = 0;
+                program->pmt.version_number = (program->pmt.version_number + 1) & 0x1f;
+            }
+        }
+    }
+}
+
+static void write_pat( ts_writer_t *w )
+{
+    int start;
+    bs_t *s = &w->out.bs;
+
+    if( w->pat_cache.size )
+    {
+        write_cached_packet( w, &w->pat_cache, &w->pat_cc );
+        increase_pcr( w, 1 );
+        return;
+    }
+
+    int pkt_start = bs_pos( s ) >> 3;
+    write_packet_header( w, 1, PAT_PID, PAYLOAD_ONLY, &w->pat_cc );
+    bs_write( s, 8, 0 ); // pointer field
+
+    start = bs_pos( s );
+    bs_write( s, 8, PAT_TID ); // table_id
+    bs_write1( s, 1 );      // section_syntax_indicator
+    bs_write1( s, 0 );      // '0'
+    bs_write( s, 2, 0x03 ); // reserved`
+
+    int section_length = (w->num_programs + !!w->network_pid) * 4 + 9;
+    bs_write( s, 12, section_length & 0x3ff );
+
+    bs_write( s, 16, w->ts_id & 0xffff ); // transport_stream_id
+    bs_write( s, 2, 0x03 ); // reserved
+    bs_write( s, 5, 0 );    // version_number
+    bs_write1( s, 1 );      // current_next_indicator
+    bs_write( s, 8, 0 );    // section_number
+    bs_write( s, 8, 0 );    // last_section_number
+
+    if( w->network_pid )
+    {
+        bs_write( s, 16, 0 );   // program_number
+        bs_write( s, 3, 0x07 ); // reserved
+        bs_write( s, 13, w->network_pid & 0x1fff ); // network_PID
+    }
+
+    for( int i = 0; i < w->num_programs; i++ )
+    {
+        bs_write( s, 16, w->programs[i]->program_num & 0xffff ); // program_number
+        bs_write( s, 3, 0x07 ); // reserved
+        bs_write( s, 13, w->programs[i]->pmt.pid & 0x1fff ); // program_map_PID
+    }
+
+    bs_flush( s );
+    write_crc( s, start );
+
+    // -40 to include header and pointer field
+    write_padding( s, start - 40 );
+    cache_packet( w, &w->pat_cache, pkt_start );
+    // TODO buffer management
+    increase_pcr( w, 1 );
+}
+
+static void write_pmt( ts_writer_t *w, ts_int_program_t *program )
+{
+    int start;
+    bs_t *s = &w->out.bs;
+
+    uint8_t temp[4096], temp2[1024];
+    bs_t q, r;
+    int section_length;
+
+    if( program->pmt_cache.size )
+    {
+        write_cached_packet( w, &program->pmt_cache, &program->pmt.cc );
+        increase_pcr( w, 1 );
+        return;
+    }
+
+    int pkt_start = bs_pos( s ) >> 3;
+    write_packet_header( w, 1, program->pmt.pid, PAYLOAD_ONLY, &program->pmt.cc );
+
+    bs_write( s, 8, 0 );       // pointer field
+
+    start = bs_pos( s );
+    bs_write( s, 8, PMT_TID ); // table_id = program_map_section
+    bs_write1( s, 1 );         // section_syntax_indicator
+    bs_write1( s, 0 );         // '0'
+    bs_write( s, 2, 0x3 );     // reserved
+
+    bs_init( &q, temp, 4096 );
+
+    bs_write( &q, 16, program->program_num & 0xffff ); // program_number
+    bs_write( &q, 2, 0x3 ); // reserved
+    bs_write( &q, 5, program->pmt.version_number & 0x1f ); // version_number
+    bs_write1( &q, 1 );      // current_next_indicator
+    bs_write( &q, 8, 0 );    // section_number
+    bs_write( &q, 8, 0 );    // last_section_number
+    bs_write( &q, 3, 0x7 );  // reserved
+
+    bs_write( &q, 13, program->pcr_stream[0].pid & 0x1fff ); // PCR PID
+    bs_write( &q, 4, 0xf );  // reserved
+
+    /* setup temporary bitstream context */
+    bs_init( &r, temp2, 1024 );
+
+    if( w->ts_type == TS_TYPE_ATSC )
+    {
+        write_registration_descriptor( &r, REGISTRATION_DESCRIPTOR_TAG, 4, "GA94" );
+        write_smoothing_buffer_descriptor( &r, program );
+    }
+    else if( w->ts_type == TS_TYPE_CABLELABS )
+        write_registration_descriptor( &r, REGISTRATION_DESCRIPTOR_TAG, 4, "SCTE" );
+    else if( w->ts_type == TS_TYPE_BLU_RAY )
+        write_registration_descriptor( &r, REGISTRATION_DESCRIPTOR_TAG, 4, "HDMV" );
+
+    if( program->cablelabs_is_3d )
+        write_cablelabs_3d_descriptor( &r );
+
+    /* Optional descriptor(s) here */
+
+    bs_flush( &r );
+    bs_write( &q, 12, bs_pos( &r ) >> 3 );   // program_info_length
+    write_bytes( &q, temp2, bs_pos( &r ) >> 3 );
+
+    for( int i = 0; i < program->num_streams; i++ )
+    {
+         ts_int_stream_t *stream = program->streams[i];
+
+         bs_write( &q, 8, stream->stream_type & 0xff ); // stream_type
+         bs_write( &q, 3, 0x7 );  // reserved
+         bs_write( &q, 13, stream->pid & 0x1fff ); // elementary_PID
+         bs_write( &q, 4, 0xf );  // reserved
+
+         /* setup temporary bitstream context */
+         bs_init( &r, temp2, 1024 );
+
+         // FIXME not in certain cases
+         write_data_stream_alignment_descriptor( &r );
+
+         if( stream->dvb_au )
+         {
+             if( w->ts_type == TS_TYPE_DVB )
+                 write_adaptation_field_data_descriptor( &r, AU_INFORMATION_DATA_FIELD );
+             else if( w->ts_type == TS_TYPE_CABLELABS )
+                 write_scte_adaptation_descriptor( &r );
+         }
+
+         if( stream->write_lang_code )
+             write_iso_lang_descriptor( &r, stream );
+
+         if( stream->has_stream_identifier )
+             write_stream_identifier_descriptor( &r, stream->stream_identifier );
+
+         if( stream->stream_format == LIBMPEGTS_VIDEO_MPEG2 )
+         {
+             if( w->ts_type == TS_TYPE_BLU_RAY )
+                 write_hdmv_video_registration_descriptor( &r, stream );
+         }
+         else if( stream->stream_format == LIBMPEGTS_VIDEO_AVC )
+         {
+             write_avc_descriptor( &r, stream );
+             if( w->ts_type == TS_TYPE_BLU_RAY )
+                 write_hdmv_video_registration_descriptor( &r, stream );
+         }
+         else if( stream->stream_format == LIBMPEGTS_AUDIO_MPEG1 ||
+                  stream->stream_format == LIBMPEGTS_AUDIO_MPEG2 )
+         {
+             // TODO
+         }
+         else if( stream->stream_format == LIBMPEGTS_AUDIO_ADTS || stream->stream_format == LIBMPEGTS_AUDIO_LATM )
+         {
+             if( w->ts_type == TS_TYPE_DVB )
+                 write_aac_descriptor( &r, stream );
+         }
+         else if( stream->stream_format == LIBMPEGTS_AUDIO_AC3 )
+         {
+             write_registration_descriptor( &r, REGISTRATION_DESCRIPTOR_TAG, 4, "AC-3" );
+             if( stream->atsc_ac3_ctx && ( w->ts_type == TS_TYPE_ATSC || w->ts_type == TS_TYPE_CABLELABS ) )
+                 write_atsc_ac3_descriptor( &r, stream->atsc_ac3_ctx );
+             else
+                 write_ac3_descriptor( w, &r, 0 );                 
+         }
+         else if( stream->stream_format == LIBMPEGTS_AUDIO_EAC3 ||
+                  stream->stream_format == LIBMPEGTS_AUDIO_EAC3_SECONDARY )
+         {
+             write_registration_descriptor( &r, REGISTRATION_DESCRIPTOR_TAG, 4, "AC-3" );
+             write_ac3_descriptor( w, &r, 1 );
+         }
+         else if( stream->stream_format == LIBMPEGTS_AUDIO_DTS )
+         {
+             // TODO
+         }
+         else if( stream->stream_format == LIBMPEGTS_AUDIO_302M )
+             write_registration_descriptor( &r, PRIVATE_DATA_DESCRIPTOR_TAG, 4, "BSSD" );
+         else if( stream->stream_format == LIBMPEGTS_DVB_SUB )
+         {
+         }
+         else if( stream->stream_format == LIBMPEGTS_DVB_TELETEXT )
+         {
+         }
+         else if( stream->stream_format == LIBMPEGTS_ANCILLARY_RDD11 )
+             write_registration_descriptor( &r, PRIVATE_DATA_DESCRIPTOR_TAG, 4, "LU-A" );
+         else if( stream->stream_format == LIBMPEGTS_ANCILLARY_2038 )
+         {
+             write_registration_descriptor( &r, PRIVATE_DATA_DESCRIPTOR_TAG, 4, "VANC" );
+             write_anc_data_descriptor( &r );
+         }
 
-        if( write_dvb_au )
-            write_dvb_au_information( &r, pes );
+         // TODO other stream_type descriptors
 
-        bs_flush ( &r );
-        bs_write( &q, 8, bs_pos( &r ) >> 3 ); // transport_private_data_length
-        write_bytes( &q, temp2, bs_pos( &r ) >> 3 );
+         /* Optional descriptor(s) here */
+
+         bs_flush( &r );
+         bs_write( &q, 12, bs_pos( &r ) >> 3 );   // ES_info_length
+         write_bytes( &q, temp2, bs_pos( &r ) >> 3 );
+    }
+
+    // FIXME this will fail with a lot of streams
+
+    bs_flush( &q );
+
+    if( 0 )
+    {
+        // TODO 21 bytes length of packet
+    }
+    else
+        section_length = bs_pos( &q ) >> 3;
+
+    /* section length includes crc */
+    section_length += 4;
+    bs_write( s, 12, section_length & 0x3ff );
+    write_bytes( s, temp, bs_pos( &q ) >> 3 );
+
+    bs_flush( s );
+    write_crc( s, start );
+
+    /* -40 to include header and pointer field */
+    write_padding( s, start - 40 );
+    cache_packet( w, &program->pmt_cache, pkt_start );
+    // TODO buffer management
+    increase_pcr( w, 1 );
+}
+
+/* DVB / Blu-Ray Service Information */
+static void write_sit( ts_writer_t *w )
+{
+    int start;
+    int len = 0; // FIXME
+    bs_t *s = &w->out.bs;
+
+    write_packet_header( w, 1, SIT_PID, PAYLOAD_ONLY, &w->sit->cc );
+    bs_write( s, 8, 0 );       // pointer field
+
+    start = bs_pos( s );
+    bs_write( s, 8, SIT_TID ); // table_id
+    bs_write1( s, 1 );         // section_syntax_indicator
+    bs_write1( s, 1 );         // DVB_reserved_future_use
+    bs_write( s, 2, 0x03 );    // ISO_reserved
+
+    // FIXME do length properly
+
+    bs_write( s, 12, 11 + len ); // section_length
+    bs_write( s, 16, 0xffff ); // DVB_reserved_future_use
+    bs_write( s, 2, 0x03 );    // ISO_reserved
+    bs_write( s, 5, w->sit->version_number ); // version_number
+    bs_write1( s, 1 );         // current_next_indicator
+    bs_write( s, 8, 0 );       // section_number
+    bs_write( s, 8, 0 );       // last_section_number
+    bs_write( s, 4, 0x0f );    // DVB_reserved_for_future_use
+
+    bs_write( s, 12, len );    // transmission_info_loop_length
+
+    if( w->ts_type == TS_TYPE_BLU_RAY )
+        write_partial_ts_descriptor( w, s );
+
+    for( int i = 0; i < w->num_programs; i++ )
+    {
+        bs_write( s, 16, w->programs[i]->program_num & 0xffff ); // service_id (equivalent to program_number)
+        bs_write1( s, 1 );      // DVB_reserved_future_use
+        bs_write( s, 3, 0x07 ); // running_status
+        bs_write( s, 12, 0 );   // service_loop_length
+    }
+
+    bs_flush( s );
+    write_crc( s, start );
+
+    // -40 to include header and pointer field
+    write_padding( s, start - 40 );
+    increase_pcr( w, 1 );
+}
+
+static void write_timestamp( bs_t *s, uint64_t timestamp )
+{
+    bs_write( s, 3, (timestamp >> 30) & 0x07 ); // timestamp [32..30]
+    bs_write1( s, 1 );                          // marker_bit
+    bs_write( s, 8, (timestamp >> 22) & 0xff ); // timestamp [29..15]
+    bs_write( s, 7, (timestamp >> 15) & 0x7f ); // timestamp [29..15]
+    bs_write1( s, 1 );                          // marker_bit
+    bs_write( s, 8, (timestamp >> 7) & 0xff );  // timestamp [14..0]
+    bs_write( s, 7, timestamp & 0x7f );         // timestamp [14..0]
+    bs_write1( s, 1 );                          // marker_bit
+}
+
+/* Overwrite a timestamp written by write_timestamp, along with its 4-bit prefix */
+static void patch_timestamp( uint8_t *p, int prefix, uint64_t timestamp )
+{
+    p[0] = (prefix << 4) | ((timestamp >> 29) & 0x0e) | 1;
+    p[1] = timestamp >> 22;
+    p[2] = ((timestamp >> 14) & 0xfe) | 1;
+    p[3] = timestamp >> 7;
+    p[4] = ((timestamp << 1) & 0xfe) | 1;
+}
+
+void write_crc( bs_t *s, int start )
+{
+    uint8_t *p_start = s->p_start;
+    int pos = (bs_pos( s ) - start) >> 3;
+    uint32_t crc = crc_32( s->p - pos, pos );
+
+    bs_init( s, s->p, s->p_end - s->p );
+    s->p_start = p_start;
+
+    bs_write32( s, crc );
+}
+
+/* Only the timestamps and PES_packet_length of a stream's pes headers change from frame to frame,
+ * so the header is built once and write_pes patches a copy */
+static void build_pes_header( ts_int_stream_t *stream, int same_timestamps, pes_header_t *header )
+{
+    bs_t s, q;
+    uint8_t temp[1024];
+
+    bs_init( &s, header->data, PES_HEADER_MAX_SIZE );
+
+    bs_write( &s, 24, 1 );   // packet_start_code_prefix
+    bs_write( &s, 8, stream->stream_id ); // stream_id
+
+    /* Initialise temp buffer */
+    bs_init( &q, temp, 1024 );
+
+    bs_write( &q, 2, 0x2 );  // '10'
+    bs_write( &q, 2, 0 );    // PES_scrambling_control
+    bs_write1( &q, 0 );      // PES_priority
+    if( stream->stream_format == LIBMPEGTS_ANCILLARY_RDD11 )
+        bs_write1( &q, 0 );  // data_alignment_indicator
+    else
+        bs_write1( &q, 1 );  // data_alignment_indicator
+    bs_write1( &q, 1 );      // copyright
+    bs_write1( &q, 1 );      // original_or_copy
+
+    bs_write( &q, 2, 0x02 + !same_timestamps ); // pts_dts_flags
+
+    bs_write1( &q, 0 );      // ESCR_flag
+    bs_write1( &q, 0 );      // ES_rate_flag
+    bs_write1( &q, 0 );      // DSM_trick_mode_flag
+    bs_write1( &q, 0 );      // additional_copy_info_flag
+    bs_write1( &q, 0 );      // PES_CRC_flag
+    bs_write1( &q, 0 );      // PES_extension_flag
+
+    if( stream->stream_format == LIBMPEGTS_DVB_TELETEXT )
+        bs_write( &q, 8, 0x24 ); // PES_header_data_length
+    else if( same_timestamps )
+        bs_write( &q, 8, 0x05 ); // PES_header_data_length (PTS only)
+    else
+        bs_write( &q, 8, 0x0a ); // PES_header_data_length (PTS and DTS)
+
+    /* PES_packet_length goes between s and q */
+    header->pts_pos = (bs_pos( &s ) >> 3) + (bs_pos( &q ) >> 3);
+    if( stream->stream_format != LIBMPEGTS_DVB_TELETEXT )
+        header->pts_pos += 2;
+    if( stream->stream_format != LIBMPEGTS_VIDEO_MPEG2 && stream->stream_format != LIBMPEGTS_VIDEO_AVC &&
+        stream->stream_format != LIBMPEGTS_DVB_TELETEXT )
+        header->length_pos = bs_pos( &s ) >> 3;
+
+    bs_write( &q, 4, 0x02 + !same_timestamps ); // '0010' or '0011'
+
+    write_timestamp( &q, 0 );     // PTS
+
+    if( !same_timestamps )
+    {
+        bs_write( &q, 4, 1 );     // '0001'
+        write_timestamp( &q, 0 ); // DTS
+    }
+
+    /* TTX requires extra stuffing */
+    if( stream->stream_format == LIBMPEGTS_DVB_TELETEXT )
+    {
+        int num_stuffing = 45 - (bs_pos( &q ) >> 3);
+        for( int i = 0; i < num_stuffing; i++ )
+            bs_write( &q, 8, 0xff );
+    }
+
+    bs_flush( &q );
+
+    if( stream->stream_format == LIBMPEGTS_DVB_TELETEXT )
+        bs_write( &q, 16, 0 );          // PES_packet_length FIXME
+    else
+        bs_write( &s, 16, 0 );          // PES_packet_length, set by write_pes for non-video streams
+
+    write_bytes( &s, temp, bs_pos( &q ) >> 3 );
+    bs_flush( &s );
+    header->size = bs_pos( &s ) >> 3;
+}
+
+static int write_pes( ts_writer_t *w, ts_int_program_t *program, ts_frame_t *in_frame, ts_int_pes_t *out_pes )
+{
+    ts_int_stream_t *stream = out_pes->stream;
+    int same_timestamps = out_pes->dts == out_pes->pts;
+    pes_header_t *header = &stream->pes_header[!same_timestamps];
+    int64_t mod = (int64_t)1 << 33;
+
+    if( !header->size )
+        build_pes_header( stream, same_timestamps, header );
+
+    int header_size = header->size;
+    uint8_t *p = out_pes->data;
+    memcpy( p, header->data, header_size );
+
+    if( header->length_pos )
+    {
+        int length = header_size - header->length_pos - 2 + in_frame->size;
+        p[header->length_pos] = length >> 8;
+        p[header->length_pos+1] = length;
+    }
+
+    patch_timestamp( p + header->pts_pos, 0x02 + !same_timestamps, out_pes->pts % mod ); // PTS
+    if( !same_timestamps )
+        patch_timestamp( p + header->pts_pos + 5, 0x01, out_pes->dts % mod );          // DTS
+
+    /* in zero-copy mode the payload is read from the caller's buffer when packets are written */
+    if( w->release_frame )
+        out_pes->payload = in_frame->data;
+    else
+    {
+        out_pes->payload = out_pes->data + header_size;
+        memcpy( out_pes->payload, in_frame->data, in_frame->size );
+    }
+
+    out_pes->size = out_pes->bytes_left = header_size + in_frame->size;
+
+    return header_size;
+}
+
+/* Write the next length bytes of a PES (header first, then payload) */
+static void write_pes_bytes( bs_t *s, ts_int_pes_t *pes, int length )
+{
+    int pos = pes->size - pes->bytes_left;
+
+    if( pos < pes->header_size )
+    {
+        int header_bytes = MIN( length, pes->header_size - pos );
+        write_bytes( s, pes->data + pos, header_bytes );
+        pos += header_bytes;
+        length -= header_bytes;
+        pes->bytes_left -= header_bytes;
+    }
+
+    if( length )
+    {
+        write_bytes( s, pes->payload + pos - pes->header_size, length );
+        pes->bytes_left -= length;
+    }
+}
+
+/**** PES pool ****/
+/* Each stream keeps the pes it has written for reuse. Data buffers grow to the largest frame
+ * seen on the stream so once the mux has warmed up frames are buffered without allocating. */
+static ts_int_pes_t *alloc_pes( ts_writer_t *w, ts_int_stream_t *stream, int size )
+{
+    ts_int_pes_t *pes = stream->pes_pool;
+    uint8_t *data = NULL;
+    int data_size = 0;
+
+    /* leave some headroom so that slowly growing frame sizes don't reallocate every time */
+    if( size > stream->pes_buf_size )
+        stream->pes_buf_size = size + size / 4;
+
+    if( pes )
+    {
+        stream->pes_pool = pes->next;
+        data = pes->data;
+        data_size = pes->data_size;
+    }
+    else
+    {
+        pes = malloc( sizeof(*pes) );
+        if( !pes )
+            return NULL;
+        stream->pool_allocs++;
+    }
+
+    if( data_size < size )
+    {
+        free( data );
+        data_size = stream->pes_buf_size;
+        data = malloc( data_size );
+        if( !data )
+        {
+            free( pes );
+            return NULL;
+        }
+        stream->pool_allocs++;
     }
+    else
+        stream->pool_reuses++;
 
-    for( int i = 0; i < stuffing; i++ )
-        bs_write( &q, 8, 0xff );
+    memset( pes, 0, sizeof(*pes) );
+    pes->data = data;
+    pes->data_size = data_size;
+    pes->stream = stream;
 
-    bs_flush( &q );
-    bs_write( s, 8, bs_pos( &q ) >> 3 ); // adaptation_field_length
-    write_bytes( s, temp, bs_pos( &q ) >> 3 );
+    return pes;
+}
 
-    return (bs_pos( s ) - start) >> 3;
+static void free_pes( ts_writer_t *w, ts_int_pes_t *pes )
+{
+    if( w->release_frame )
+        w->release_frame( w->release_opaque, pes->payload );
+
+    /* the pools belong to the thread calling ts_queue_frames */
+    if( w->pipeline )
+    {
+        if( !ring_push( &w->done_pes, &pes, 1, 0 ) )
+        {
+            free( pes->data );
+            free( pes );
+        }
+        return;
+    }
+
+    pool_pes( pes );
 }
 
-static void write_pcr_empty( ts_writer_t *w, ts_int_program_t *program, int first )
+/* Return a pes to its stream's pool without releasing the frame */
+static void pool_pes( ts_int_pes_t *pes )
 {
-    bs_t *s = &w->out.bs;
+    ts_int_stream_t *stream = pes->stream;
 
-    write_packet_header( w, 0, program->pcr_stream->pid, ADAPT_FIELD_ONLY, &program->pcr_stream->cc );
-    int stuffing = 184 - 6 - 2; /* pcr, flags and length */
-    int discontinuity = first && w->ts_type == TS_TYPE_CABLELABS;
-    write_adaptation_field( w, s, program, NULL, 1, 1, stuffing, discontinuity );
+    /* a probe which never took effect */
+    if( pes->ac3_info )
+    {
+        free( pes->ac3_info );
+        pes->ac3_info = NULL;
+        stream->ac3_probed = 0;
+    }
 
-    add_to_buffer( &program->pcr_stream->tb );
-    increase_pcr( w, 1 );
+    pes->next = stream->pes_pool;
+    stream->pes_pool = pes;
 }
 
-/**** PSI ****/
-static void write_pat( ts_writer_t *w )
+static void free_pes_pool( ts_int_stream_t *stream )
 {
-    int start;
-    bs_t *s = &w->out.bs;
+    while( stream->pes_pool )
+    {
+        ts_int_pes_t *next = stream->pes_pool->next;
+        free( stream->pes_pool->data );
+        free( stream->pes_pool );
+        stream->pes_pool = next;
+    }
+}
 
-    write_packet_header( w, 1, PAT_PID, PAYLOAD_ONLY, &w->pat_cc );
-    bs_write( s, 8, 0 ); // pointer field
+/**** Packetization ****/
+/* Check the frames and build their pes into w->frame_pes. With packetization threads the programs are
+ * built in parallel. Returns the number of leading frames whose pes were built, the rest are discarded */
+static int prepare_frames( ts_writer_t *w, ts_frame_t *frames, int num_frames )
+{
+    int num_valid;
+    for( num_valid = 0; num_valid < num_frames; num_valid++ )
+    {
+        ts_int_stream_t *stream = find_stream( w, frames[num_valid].pid );
 
-    start = bs_pos( s );
-    bs_write( s, 8, PAT_TID ); // table_id
-    bs_write1( s, 1 );      // section_syntax_indicator
-    bs_write1( s, 0 );      // '0'
-    bs_write( s, 2, 0x03 ); // reserved`
+        if( !stream )
+        {
+            fprintf( stderr, "PID %i not found for frame %i\n", frames[num_valid].pid, num_valid );
+            break;
+        }
 
-    // FIXME when multiple programs are allowed do this properly
-    int section_length = w->num_programs * 4 + w->network_pid * 4 + 9;
-    bs_write( s, 12, section_length & 0x3ff );
+        if( ( stream->stream_format == LIBMPEGTS_VIDEO_MPEG2 || stream->stream_format == LIBMPEGTS_VIDEO_AVC ) && !stream->mpegvideo_ctx )
+        {
+            fprintf( stderr, "MPEG video stream needs additional information. Call ts_setup_mpegvideo_stream \n" );
+            break;
+        }
+    }
+    num_frames = num_valid;
 
-    bs_write( s, 16, w->ts_id & 0xffff ); // transport_stream_id
-    bs_write( s, 2, 0x03 ); // reserved
-    bs_write( s, 5, 0 );    // version_number
-    bs_write1( s, 1 );      // current_next_indicator
-    bs_write( s, 8, 0 );    // section_number
-    bs_write( s, 8, 0 );    // last_section_number
+    if( !num_frames )
+        return 0;
 
-    if( w->network_pid )
+    if( num_frames > w->max_frame_pes )
     {
-        bs_write( s, 16, 0 );   // program_number
-        bs_write( s, 3, 0x07 ); // reserved
-        bs_write( s, 13, w->network_pid & 0x1fff ); // network_PID
+        ts_int_pes_t **frame_pes = realloc( w->frame_pes, num_frames * sizeof(*frame_pes) );
+        if( !frame_pes )
+        {
+            fprintf( stderr, "Malloc failed\n" );
+            return 0;
+        }
+        w->frame_pes = frame_pes;
+        w->max_frame_pes = num_frames;
     }
+    memset( w->frame_pes, 0, num_frames * sizeof(*w->frame_pes) );
 
-    for( int i = 0; i < w->num_programs; i++ )
+    PROFILE_START_ALONE( PROFILE_PES );
+
+#if HAVE_PTHREAD
+    if( w->num_threads > 1 && w->num_programs > 1 )
+        run_build_jobs( w, frames, num_frames );
+    else
+#endif
+        build_pes( w, NULL, frames, num_frames );
+
+    PROFILE_STOP_ALONE( w, PROFILE_PES );
+
+    int num_built = 0;
+    while( num_built < num_frames && w->frame_pes[num_built] )
+        num_built++;
+    for( int i = num_built + 1; i < num_frames; i++ )
     {
-        bs_write( s, 16, w->programs[i]->program_num & 0xffff ); // program_number
-        bs_write( s, 3, 0x07 ); // reserved
-        bs_write( s, 13, w->programs[i]->pmt.pid & 0x1fff ); // program_map_PID
+        if( w->frame_pes[i] )
+            pool_pes( w->frame_pes[i] );
     }
 
-    bs_flush( s );
-    write_crc( s, start );
+    return num_built;
+}
 
-    // -40 to include header and pointer field
-    write_padding( s, start - 40 );
-    // TODO buffer management
-    increase_pcr( w, 1 );
+/* Build the pes of the frames belonging to the program (all programs if NULL).
+ * Only the pools and probes of the program's own streams are modified */
+static void build_pes( ts_writer_t *w, ts_int_program_t *program, ts_frame_t *frames, int num_frames )
+{
+    for( int i = 0; i < num_frames; i++ )
+    {
+        ts_int_stream_t *stream = find_stream( w, frames[i].pid );
+        if( program && stream->program != program )
+            continue;
+
+        /* 512 bytes is more than enough for pes overhead */
+        ts_int_pes_t *new_pes = alloc_pes( w, stream, w->release_frame ? PES_HEADER_MAX_SIZE : frames[i].size + 512 );
+        if( !new_pes )
+        {
+           fprintf( stderr, "Malloc failed\n" );
+           return;
+        }
+
+        new_pes->random_access = !!frames[i].random_access;
+        new_pes->priority = !!frames[i].priority;
+        new_pes->dts = frames[i].dts;
+        new_pes->pts = frames[i].pts;
+        new_pes->frame_type = frames[i].frame_type;
+        new_pes->ref_pic_idc = frames[i].ref_pic_idc;
+        new_pes->write_pulldown_info = frames[i].write_pulldown_info;
+        new_pes->pic_struct = frames[i].pic_struct;
+
+        /* probe the first normal looking ac3 frame if extra data is needed */
+        if( !stream->ac3_probed && stream->stream_format == LIBMPEGTS_AUDIO_AC3 &&
+            ( w->ts_type == TS_TYPE_CABLELABS || w->ts_type == TS_TYPE_ATSC ) &&
+            frames[i].size > 100 &&  frames[i].data[0] == 0xb && frames[i].data[1] == 0x77 )
+        {
+            new_pes->ac3_info = calloc( 1, sizeof(ts_atsc_ac3_info) );
+            if( !new_pes->ac3_info )
+            {
+               fprintf( stderr, "Malloc failed\n" );
+               pool_pes( new_pes );
+               return;
+            }
+            parse_ac3_frame( new_pes->ac3_info, frames[i].data );
+            stream->ac3_probed = 1;
+        }
+
+        new_pes->header_size = write_pes( w, stream->program, &frames[i], new_pes );
+        plan_pes( new_pes );
+        w->frame_pes[i] = new_pes;
+    }
 }
 
-static void write_pmt( ts_writer_t *w, ts_int_program_t *program )
+#if HAVE_PTHREAD
+/* Run the remaining jobs of the current call. Called with the thread mutex held */
+static void run_jobs( ts_writer_t *w )
 {
-    int start;
-    bs_t *s = &w->out.bs;
+    while( w->next_job < w->num_programs )
+    {
+        ts_int_program_t *program = w->programs[w->next_job++];
 
-    uint8_t temp[4096], temp2[1024];
-    bs_t q, r;
-    int section_length;
+        pthread_mutex_unlock( &w->thread_mutex );
+        build_pes( w, program, w->job_frames, w->num_job_frames );
+        pthread_mutex_lock( &w->thread_mutex );
 
-    write_packet_header( w, 1, program->pmt.pid, PAYLOAD_ONLY, &program->pmt.cc );
+        if( !--w->jobs_left )
+            pthread_cond_signal( &w->done_cond );
+    }
+}
 
-    bs_write( s, 8, 0 );       // pointer field
+static void run_build_jobs( ts_writer_t *w, ts_frame_t *frames, int num_frames )
+{
+    pthread_mutex_lock( &w->thread_mutex );
+    w->job_frames = frames;
+    w->num_job_frames = num_frames;
+    w->next_job = 0;
+    w->jobs_left = w->num_programs;
+    w->job_id++;
+    pthread_cond_broadcast( &w->job_cond );
+
+    run_jobs( w );
+    while( w->jobs_left )
+        pthread_cond_wait( &w->done_cond, &w->thread_mutex );
+    pthread_mutex_unlock( &w->thread_mutex );
+}
 
-    start = bs_pos( s );
-    bs_write( s, 8, PMT_TID ); // table_id = program_map_section
-    bs_write1( s, 1 );         // section_syntax_indicator
-    bs_write1( s, 0 );         // '0'
-    bs_write( s, 2, 0x3 );     // reserved
+static void *build_thread( void *arg )
+{
+    ts_writer_t *w = arg;
 
-    bs_init( &q, temp, 4096 );
+    pthread_mutex_lock( &w->thread_mutex );
+    int64_t job_id = w->job_id;
+    while( 1 )
+    {
+        while( job_id == w->job_id && !w->thread_exit )
+            pthread_cond_wait( &w->job_cond, &w->thread_mutex );
+        if( w->thread_exit )
+            break;
 
-    bs_write( &q, 16, program->program_num & 0xffff ); // program_number
-    bs_write( &q, 2, 0x3 ); // reserved
-    bs_write( &q, 5, 0 );    // version_number
-    bs_write1( &q, 1 );      // current_next_indicator
-    bs_write( &q, 8, 0 );    // section_number
-    bs_write( &q, 8, 0 );    // last_section_number
-    bs_write( &q, 3, 0x7 );  // reserved
+        job_id = w->job_id;
+        run_jobs( w );
+    }
+    pthread_mutex_unlock( &w->thread_mutex );
 
-    bs_write( &q, 13, program->pcr_stream[0].pid & 0x1fff ); // PCR PID
-    bs_write( &q, 4, 0xf );  // reserved
+    return NULL;
+}
+#endif
 
-    /* setup temporary bitstream context */
-    bs_init( &r, temp2, 1024 );
+static void stop_threads( ts_writer_t *w )
+{
+#if HAVE_PTHREAD
+    if( !w->threads )
+        return;
+
+    pthread_mutex_lock( &w->thread_mutex );
+    w->thread_exit = 1;
+    pthread_cond_broadcast( &w->job_cond );
+    pthread_mutex_unlock( &w->thread_mutex );
+
+    for( int i = 0; i < w->num_threads - 1; i++ )
+        pthread_join( w->threads[i], NULL );
+
+    pthread_mutex_destroy( &w->thread_mutex );
+    pthread_cond_destroy( &w->job_cond );
+    pthread_cond_destroy( &w->done_cond );
+    free( w->threads );
+    w->threads = NULL;
+    w->num_threads = 0;
+#endif
+}
 
-    if( w->ts_type == TS_TYPE_ATSC )
+/**** Output ****/
+static int packet_size( ts_writer_t *w )
+{
+    return (w->ts_type == TS_TYPE_BLU_RAY ? TS_PACKET_SIZE + 4 : TS_PACKET_SIZE) + w->out.null_deletion;
+}
+
+/* With null packet deletion each packet starts with the number of null packets deleted just before it */
+static void write_deleted_count( ts_writer_t *w )
+{
+    bs_t *s = &w->out.bs;
+
+    if( w->out.null_deletion )
     {
-        write_registration_descriptor( &r, REGISTRATION_DESCRIPTOR_TAG, 4, "GA94" );
-        write_smoothing_buffer_descriptor( &r, program );
+        bs_flush_bytes( s );
+        *s->p++ = w->out.deleted_nulls;
+        w->out.deleted_nulls = 0;
     }
-    else if( w->ts_type == TS_TYPE_CABLELABS )
-        write_registration_descriptor( &r, REGISTRATION_DESCRIPTOR_TAG, 4, "SCTE" );
-    else if( w->ts_type == TS_TYPE_BLU_RAY )
-        write_registration_descriptor( &r, REGISTRATION_DESCRIPTOR_TAG, 4, "HDMV" );
+}
 
-    if( program->cablelabs_is_3d )
-        write_cablelabs_3d_descriptor( &r );
+/* Number of packets sent from the start of the packet at byte position pos of the output until the current time,
+ * out of len bytes written. This includes deleted null packets */
+static int64_t packets_from( ts_writer_t *w, int pos, int len )
+{
+    int size = packet_size( w );
+    int64_t packets = (len - pos) / size;
 
-    /* Optional descriptor(s) here */
+    if( w->out.null_deletion )
+    {
+        for( int i = pos + size; i < len; i += size )
+            packets += w->out.bs.p_start[i];
+        packets += w->out.deleted_nulls;
+    }
 
-    bs_flush( &r );
-    bs_write( &q, 12, bs_pos( &r ) >> 3 );   // program_info_length
-    write_bytes( &q, temp2, bs_pos( &r ) >> 3 );
+    return packets;
+}
 
-    for( int i = 0; i < program->num_streams; i++ )
+/* Pass the written packets to the output callback, either all of them or only complete chunks.
+ * The rest is moved to the start of the buffer */
+static int flush_output( ts_writer_t *w, int all )
+{
+    bs_t *s = &w->out.bs;
+    int chunk_size = w->out.chunk_packets * packet_size( w );
+    int ret = 0;
+
+    bs_flush_bytes( s );
+    int len = s->p - s->p_start;
+    int size = all ? len : len - len % chunk_size;
+
+    if( !size )
+        return 0;
+
+    PROFILE_START( w, PROFILE_OUTPUT );
+
+    /* release each chunk when the PCR of its first packet is due. The packets in the buffer
+     * were written just before the current time */
+    for( int pos = 0; pos < size; pos += chunk_size )
     {
-         ts_int_stream_t *stream = program->streams[i];
+        int chunk = MIN( chunk_size, size - pos );
 
-         bs_write( &q, 8, stream->stream_type & 0xff ); // stream_type
-         bs_write( &q, 3, 0x7 );  // reserved
-         bs_write( &q, 13, stream->pid & 0x1fff ); // elementary_PID
-         bs_write( &q, 4, 0xf );  // reserved
+        if( w->pacing.enabled )
+        {
+            int64_t packets_left = packets_from( w, pos, len );
+            pace_output( w, w->cur_pcr - (packets_left * TS_PACKET_SIZE * 8 * TS_CLOCK - w->cur_pcr_rem) / w->ts_muxrate );
+        }
 
-         /* setup temporary bitstream context */
-         bs_init( &r, temp2, 1024 );
+        int taken = w->out.write_packets( w->out.write_opaque, s->p_start + pos, chunk );
+        if( taken < chunk )
+        {
+            /* the chunks before this one and the start of this one were delivered */
+            fprintf( stderr, "Output callback failed\n" );
+            size = pos + MAX( taken, 0 );
+            ret = -1;
+            break;
+        }
+    }
 
-         // FIXME not in certain cases
-         write_data_stream_alignment_descriptor( &r );
+    memmove( s->p_start, s->p_start + size, len - size );
+    s->p = s->p_start + len - size;
+    w->out.unsent = len - size;
 
-         if( stream->dvb_au )
-         {
-             if( w->ts_type == TS_TYPE_DVB )
-                 write_adaptation_field_data_descriptor( &r, AU_INFORMATION_DATA_FIELD );
-             else if( w->ts_type == TS_TYPE_CABLELABS )
-                 write_scte_adaptation_descriptor( &r );
-         }
+    PROFILE_STOP( w, PROFILE_OUTPUT );
 
-         if( stream->write_lang_code )
-             write_iso_lang_descriptor( &r, stream );
+    return ret;
+}
 
-         if( stream->has_stream_identifier )
-             write_stream_identifier_descriptor( &r, stream->stream_identifier );
+/* Wait until the time of the pcr, measured from the first paced chunk */
+static void pace_output( ts_writer_t *w, int64_t pcr )
+{
+    if( !w->pacing.num_bursts )
+    {
+        w->pacing.anchor_time = monotonic_time();
+        w->pacing.anchor_pcr = pcr;
+    }
 
-         if( stream->stream_format == LIBMPEGTS_VIDEO_MPEG2 )
-         {
-             if( w->ts_type == TS_TYPE_BLU_RAY )
-                 write_hdmv_video_registration_descriptor( &r, stream );
-         }
-         else if( stream->stream_format == LIBMPEGTS_VIDEO_AVC )
-         {
-             write_avc_descriptor( &r, stream );
-             if( w->ts_type == TS_TYPE_BLU_RAY )
-                 write_hdmv_video_registration_descriptor( &r, stream );
-         }
-         else if( stream->stream_format == LIBMPEGTS_AUDIO_MPEG1 ||
-                  stream->stream_format == LIBMPEGTS_AUDIO_MPEG2 )
-         {
-             // TODO
-         }
-         else if( stream->stream_format == LIBMPEGTS_AUDIO_ADTS || stream->stream_format == LIBMPEGTS_AUDIO_LATM )
-         {
-             if( w->ts_type == TS_TYPE_DVB )
-                 write_aac_descriptor( &r, stream );
-         }
-         else if( stream->stream_format == LIBMPEGTS_AUDIO_AC3 )
-         {
-             write_registration_descriptor( &r, REGISTRATION_DESCRIPTOR_TAG, 4, "AC-3" );
-             if( stream->atsc_ac3_ctx && ( w->ts_type == TS_TYPE_ATSC || w->ts_type == TS_TYPE_CABLELABS ) )
-                 write_atsc_ac3_descriptor( &r, stream->atsc_ac3_ctx );
-             else
-                 write_ac3_descriptor( w, &r, 0 );                 
-         }
-         else if( stream->stream_format == LIBMPEGTS_AUDIO_EAC3 ||
-                  stream->stream_format == LIBMPEGTS_AUDIO_EAC3_SECONDARY )
-         {
-             write_registration_descriptor( &r, REGISTRATION_DESCRIPTOR_TAG, 4, "AC-3" );
-             write_ac3_descriptor( w, &r, 1 );
-         }
-         else if( stream->stream_format == LIBMPEGTS_AUDIO_DTS )
-         {
-             // TODO
-         }
-         else if( stream->stream_format == LIBMPEGTS_AUDIO_302M )
-             write_registration_descriptor( &r, PRIVATE_DATA_DESCRIPTOR_TAG, 4, "BSSD" );
-         else if( stream->stream_format == LIBMPEGTS_DVB_SUB )
-         {
-         }
-         else if( stream->stream_format == LIBMPEGTS_DVB_TELETEXT )
-         {
-         }
-         else if( stream->stream_format == LIBMPEGTS_ANCILLARY_RDD11 )
-             write_registration_descriptor( &r, PRIVATE_DATA_DESCRIPTOR_TAG, 4, "LU-A" );
-         else if( stream->stream_format == LIBMPEGTS_ANCILLARY_2038 )
-         {
-             write_registration_descriptor( &r, PRIVATE_DATA_DESCRIPTOR_TAG, 4, "VANC" );
-             write_anc_data_descriptor( &r );
-         }
+    int64_t nominal = w->pacing.anchor_time + (pcr - w->pacing.anchor_pcr) * 1000 / 27;
+    int64_t wakeup = nominal - w->pacing.spin_ns;
+    int64_t now = monotonic_time();
 
-         // TODO other stream_type descriptors
+    if( wakeup > now )
+    {
+#if HAVE_CLOCK_NANOSLEEP
+        struct timespec ts = { .tv_sec = wakeup / 1000000000, .tv_nsec = wakeup % 1000000000 };
+        while( clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL ) == EINTR )
+            ;
+#else
+        struct timespec ts = { .tv_sec = (wakeup - now) / 1000000000, .tv_nsec = (wakeup - now) % 1000000000 };
+        nanosleep( &ts, NULL );
+#endif
+    }
 
-         /* Optional descriptor(s) here */
+    /* busy-wait for the rest */
+    do
+        now = monotonic_time();
+    while( now < nominal );
 
-         bs_flush( &r );
-         bs_write( &q, 12, bs_pos( &r ) >> 3 );   // ES_info_length
-         write_bytes( &q, temp2, bs_pos( &r ) >> 3 );
+    int64_t offset = now - nominal;
+    w->pacing.sum_offset += offset;
+    w->pacing.max_offset = MAX( w->pacing.max_offset, offset );
+    if( w->pacing.num_bursts )
+    {
+        int64_t jitter = llabs( (now - w->pacing.last_release) - (nominal - w->pacing.last_nominal) );
+        w->pacing.max_jitter = MAX( w->pacing.max_jitter, jitter );
     }
+    w->pacing.last_release = now;
+    w->pacing.last_nominal = nominal;
+    w->pacing.num_bursts++;
+}
 
-    // FIXME this will fail with a lot of streams
+/**** Pipeline ****/
+static int ring_init( ts_pes_ring_t *ring, int size )
+{
+    int entries = 1;
+    while( entries < size )
+        entries <<= 1;
 
-    bs_flush( &q );
+    ring->pes = malloc( entries * sizeof(*ring->pes) );
+    if( !ring->pes )
+        return -1;
+    ring->mask = entries - 1;
+    ring->head = ring->tail = 0;
 
-    if( 0 )
+    return 0;
+}
+
+/* Number of free entries. Called by the producer */
+static int ring_space( ts_pes_ring_t *ring )
+{
+    int64_t tail = __atomic_load_n( &ring->tail, __ATOMIC_RELAXED );
+    return ring->mask + 1 - (tail - __atomic_load_n( &ring->head, __ATOMIC_ACQUIRE ));
+}
+
+/* Add the pes at once, followed by a NULL entry if end_batch is set.
+ * Returns 0 if there is not enough space. Called by the producer */
+static int ring_push( ts_pes_ring_t *ring, ts_int_pes_t **pes, int num_pes, int end_batch )
+{
+    int64_t tail = __atomic_load_n( &ring->tail, __ATOMIC_RELAXED );
+
+    if( num_pes + end_batch > ring_space( ring ) )
+        return 0;
+
+    for( int i = 0; i < num_pes; i++ )
+        ring->pes[(tail + i) & ring->mask] = pes[i];
+    if( end_batch )
+        ring->pes[(tail + num_pes) & ring->mask] = NULL;
+    /* publishes the entries and the pes contents to the consumer */
+    __atomic_store_n( &ring->tail, tail + num_pes + end_batch, __ATOMIC_RELEASE );
+
+    return 1;
+}
+
+/* Called by the consumer */
+static int ring_empty( ts_pes_ring_t *ring )
+{
+    return __atomic_load_n( &ring->head, __ATOMIC_RELAXED ) == __atomic_load_n( &ring->tail, __ATOMIC_ACQUIRE );
+}
+
+/* Returns NULL if the ring is empty or at the end of a batch. Called by the consumer */
+static ts_int_pes_t *ring_pop( ts_pes_ring_t *ring )
+{
+    int64_t head = __atomic_load_n( &ring->head, __ATOMIC_RELAXED );
+
+    if( head == __atomic_load_n( &ring->tail, __ATOMIC_ACQUIRE ) )
+        return NULL;
+
+    ts_int_pes_t *pes = ring->pes[head & ring->mask];
+    __atomic_store_n( &ring->head, head + 1, __ATOMIC_RELEASE );
+
+    return pes;
+}
+
+/* Queue the pes prepared by one call of ts_queue_frames. Returns the number of pes */
+static int take_ready_pes( ts_writer_t *w )
+{
+    ts_int_pes_t *pes;
+    int num_pes = 0;
+
+    while( (pes = ring_pop( &w->ready_pes )) )
     {
-        // TODO 21 bytes length of packet
+        queue_pes( w, pes );
+        num_pes++;
     }
-    else
-        section_length = bs_pos( &q ) >> 3;
 
-    /* section length includes crc */
-    section_length += 4;
-    bs_write( s, 12, section_length & 0x3ff );
-    write_bytes( s, temp, bs_pos( &q ) >> 3 );
+    return num_pes;
+}
 
-    bs_flush( s );
-    write_crc( s, start );
+/* Return the pes written by ts_write_frames to their pools */
+static void take_done_pes( ts_writer_t *w )
+{
+    ts_int_pes_t *pes;
 
-    /* -40 to include header and pointer field */
-    write_padding( s, start - 40 );
-    // TODO buffer management
-    increase_pcr( w, 1 );
+    while( (pes = ring_pop( &w->done_pes )) )
+        pool_pes( pes );
 }
 
-/* DVB / Blu-Ray Service Information */
-static void write_sit( ts_writer_t *w )
+/* Prepared frames which were not taken yet are written by the next call of ts_write_frames */
+static void stop_pipeline( ts_writer_t *w )
 {
-    int start;
-    int len = 0; // FIXME
-    bs_t *s = &w->out.bs;
-
-    write_packet_header( w, 1, SIT_PID, PAYLOAD_ONLY, &w->sit->cc );
-    bs_write( s, 8, 0 );       // pointer field
+    if( !w->pipeline )
+        return;
+
+    while( !ring_empty( &w->ready_pes ) )
+        take_ready_pes( w );
+    take_done_pes( w );
+    free( w->ready_pes.pes );
+    free( w->done_pes.pes );
+    memset( &w->ready_pes, 0, sizeof(w->ready_pes) );
+    memset( &w->done_pes, 0, sizeof(w->done_pes) );
+    w->pipeline = 0;
+}
 
-    start = bs_pos( s );
-    bs_write( s, 8, SIT_TID ); // table_id
-    bs_write1( s, 1 );         // section_syntax_indicator
-    bs_write1( s, 1 );         // DVB_reserved_future_use
-    bs_write( s, 2, 0x03 );    // ISO_reserved
+/**** Scheduling ****/
+/* Whether the pes is written during the current call of ts_write_frames */
+static int is_current( ts_writer_t *w, ts_int_pes_t *pes )
+{
+    return pes->write_idx <= w->write_idx;
+}
 
-    // FIXME do length properly
+/* earliest time that a frame can arrive */
+static int64_t arrival_time( ts_int_pes_t *pes )
+{
+    return (pes->dts - pes->stream->max_frame_size) * 300;
+}
 
-    bs_write( s, 12, 11 + len ); // section_length
-    bs_write( s, 16, 0xffff ); // DVB_reserved_future_use
-    bs_write( s, 2, 0x03 );    // ISO_reserved
-    bs_write( s, 5, w->sit->version_number ); // version_number
-    bs_write1( s, 1 );         // current_next_indicator
-    bs_write( s, 8, 0 );       // section_number
-    bs_write( s, 8, 0 );       // last_section_number
-    bs_write( s, 4, 0x0f );    // DVB_reserved_for_future_use
+/* Add the pes to the end of its stream's queue. It is written during the next call of ts_write_frames */
+static void queue_pes( ts_writer_t *w, ts_int_pes_t *pes )
+{
+    ts_int_stream_t *stream = pes->stream;
 
-    bs_write( s, 12, len );    // transmission_info_loop_length
+    pes->seq = w->pes_seq++;
+    pes->write_idx = w->write_idx + 1;
 
-    if( w->ts_type == TS_TYPE_BLU_RAY )
-        write_partial_ts_descriptor( w, s );
+    /* checked here rather than when the pes is built, which may be on another thread */
+    if( pes->dts > pes->pts )
+        report_diag( w, LIBMPEGTS_DIAG_DTS_AFTER_PTS, pes );
 
-    for( int i = 0; i < w->num_programs; i++ )
+    if( pes->ac3_info )
     {
-        bs_write( s, 16, w->programs[i]->program_num & 0xffff ); // service_id (equivalent to program_number)
-        bs_write1( s, 1 );      // DVB_reserved_future_use
-        bs_write( s, 3, 0x07 ); // running_status
-        bs_write( s, 12, 0 );   // service_loop_length
+        stream->atsc_ac3_ctx = pes->ac3_info;
+        pes->ac3_info = NULL;
+        invalidate_pmt( w, stream );
     }
 
-    bs_flush( s );
-    write_crc( s, start );
+    if( stream->stream_format == LIBMPEGTS_VIDEO_MPEG2 || stream->stream_format == LIBMPEGTS_VIDEO_AVC )
+        stream->program->video_dts = pes->dts;
 
-    // -40 to include header and pointer field
-    write_padding( s, start - 40 );
-    increase_pcr( w, 1 );
+    if( stream->pes_tail )
+        stream->pes_tail->next = pes;
+    else
+        stream->pes_head = pes;
+    stream->pes_tail = pes;
+
+    w->num_buffered_frames++;
 }
 
-static void write_timestamp( bs_t *s, uint64_t timestamp )
+/* Remove the pes (which must be at the front of its stream's queue) */
+static void dequeue_pes( ts_writer_t *w, ts_int_program_t *program, ts_int_pes_t *pes )
 {
-    bs_write( s, 3, (timestamp >> 30) & 0x07 ); // timestamp [32..30]
-    bs_write1( s, 1 );                          // marker_bit
-    bs_write( s, 8, (timestamp >> 22) & 0xff ); // timestamp [29..15]
-    bs_write( s, 7, (timestamp >> 15) & 0x7f ); // timestamp [29..15]
-    bs_write1( s, 1 );                          // marker_bit
-    bs_write( s, 8, (timestamp >> 7) & 0xff );  // timestamp [14..0]
-    bs_write( s, 7, timestamp & 0x7f );         // timestamp [14..0]
-    bs_write1( s, 1 );                          // marker_bit
+    ts_int_stream_t *stream = pes->stream;
+
+    stream->pes_head = pes->next;
+    if( !stream->pes_head )
+        stream->pes_tail = NULL;
+
+    w->num_buffered_frames--;
+
+    if( stream->stream_format > 31 )
+    {
+        /* the next pes normally arrives later, but nothing stops the DTS going backwards (e.g. after a splice) */
+        if( stream->pes_head && is_current( w, stream->pes_head ) )
+        {
+            pes_heap_sift_up( program, stream->heap_pos );
+            pes_heap_sift_down( program, stream->heap_pos );
+        }
+        else
+            pes_heap_remove( program, stream );
+    }
 }
 
-void write_crc( bs_t *s, int start )
+/* Whether no other video pes is left to write during the current call */
+static int is_last_video_pes( ts_writer_t *w, ts_int_pes_t *pes )
 {
-    uint8_t *p_start = s->p_start;
-    int pos = (bs_pos( s ) - start) >> 3;
-    uint32_t crc = crc_32( s->p - pos, pos );
+    if( pes->next && is_current( w, pes->next ) )
+        return 0;
 
-    bs_init( s, s->p, s->p_end - s->p );
-    s->p_start = p_start;
+    for( int i = 0; i < w->num_programs; i++ )
+    {
+        ts_int_stream_t *stream = w->programs[i]->video_stream;
+        if( stream && stream != pes->stream && stream->pes_head && is_current( w, stream->pes_head ) )
+            return 0;
+    }
 
-    bs_write32( s, crc );
+    return 1;
 }
 
-static int write_pes( ts_writer_t *w, ts_int_program_t *program, ts_frame_t *in_frame, ts_int_pes_t *out_pes )
+/* Send the non-video pes which cannot arrive yet to the next call of ts_write_frames.
+ * Returns the number of pes deferred */
+static int defer_pes( ts_writer_t *w, ts_int_program_t *program )
 {
-    bs_t s, q;
-    uint8_t temp[1024];
-    int header_size, total_size;
-    int64_t mod = (int64_t)1 << 33;
+    int num_deferred = 0;
+
+    for( int i = 0; i < program->num_streams; i++ )
+    {
+        ts_int_stream_t *stream = program->streams[i];
+        ts_int_pes_t *pes = stream->pes_head;
 
-    if( out_pes->dts > out_pes->pts )
-        fprintf( stderr, "\nError: DTS > PTS\n" );
+        if( stream->stream_format <= 31 )
+            continue;
 
-    bs_init( &s, out_pes->data, in_frame->size + 200 );
+        /* arrival times increase along the queue so only the end of it is deferred */
+        while( pes && is_current( w, pes ) && arrival_time( pes ) <= w->cur_pcr )
+            pes = pes->next;
 
-    ts_int_stream_t *stream = out_pes->stream;
+        if( !pes || !is_current( w, pes ) )
+            continue;
 
-    bs_write( &s, 24, 1 );   // packet_start_code_prefix
-    bs_write( &s, 8, stream->stream_id ); // stream_id
+        if( pes == stream->pes_head )
+            pes_heap_remove( program, stream );
 
-    /* Initialise temp buffer */
-    bs_init( &q, temp, 1024 );
+        for( ; pes && is_current( w, pes ); pes = pes->next )
+        {
+            pes->write_idx = w->write_idx + 1;
+            num_deferred++;
+        }
+    }
 
-    bs_write( &q, 2, 0x2 );  // '10'
-    bs_write( &q, 2, 0 );    // PES_scrambling_control
-    bs_write1( &q, 0 );      // PES_priority
-    if( stream->stream_format == LIBMPEGTS_ANCILLARY_RDD11 )
-        bs_write1( &q, 0 );  // data_alignment_indicator
-    else
-        bs_write1( &q, 1 );  // data_alignment_indicator
-    bs_write1( &q, 1 );      // copyright
-    bs_write1( &q, 1 );      // original_or_copy
+    return num_deferred;
+}
 
-    int same_timestamps = out_pes->dts == out_pes->pts;
+/* Latest time by which the EDF scheduler aims to finish the pes */
+static int64_t pes_deadline( ts_int_pes_t *pes )
+{
+    int64_t deadline = pes->dts * 300;
 
-    bs_write( &q, 2, 0x02 + !same_timestamps ); // pts_dts_flags
+    /* compared as a delay so that a large maximum delay can't overflow */
+    if( pes->stream->max_delay && pes->stream->max_delay < deadline - arrival_time( pes ) )
+        deadline = arrival_time( pes ) + pes->stream->max_delay;
 
-    bs_write1( &q, 0 );      // ESCR_flag
-    bs_write1( &q, 0 );      // ES_rate_flag
-    bs_write1( &q, 0 );      // DSM_trick_mode_flag
-    bs_write1( &q, 0 );      // additional_copy_info_flag
-    bs_write1( &q, 0 );      // PES_CRC_flag
-    bs_write1( &q, 0 );      // PES_extension_flag
+    return deadline;
+}
 
-    if( stream->stream_format == LIBMPEGTS_DVB_TELETEXT )
-        bs_write( &q, 8, 0x24 ); // PES_header_data_length
-    else if( same_timestamps )
-        bs_write( &q, 8, 0x05 ); // PES_header_data_length (PTS only)
-    else
-        bs_write( &q, 8, 0x0a ); // PES_header_data_length (PTS and DTS)
+/* Whether the scheduler prefers pes a to pes b: the earlier dts, or deadline with EDF.
+ * Ties go to the pes which was queued first */
+static int pes_before( ts_writer_t *w, ts_int_pes_t *a, ts_int_pes_t *b )
+{
+    if( w->scheduler == LIBMPEGTS_SCHEDULER_EDF )
+    {
+        int64_t deadline_a = pes_deadline( a ), deadline_b = pes_deadline( b );
+        if( deadline_a != deadline_b )
+            return deadline_a < deadline_b;
+    }
+    else if( a->dts != b->dts )
+        return a->dts < b->dts;
 
-    bs_write( &q, 4, 0x02 + !same_timestamps ); // '0010' or '0011'
+    return a->seq < b->seq;
+}
+
+/* Find the non-video pes which the scheduler prefers out of those which have arrived and whose
+ * transport buffer is empty. Only the part of the heap which has arrived is visited. */
+static ts_int_pes_t *find_next_pes( ts_writer_t *w, ts_int_program_t *program, int i, ts_int_pes_t *pes )
+{
+    if( i >= program->num_pes_heap )
+        return pes;
 
-    write_timestamp( &q, out_pes->pts % mod );     // PTS
+    ts_int_stream_t *stream = program->pes_heap[i];
+    ts_int_pes_t *head = stream->pes_head;
 
-    if( !same_timestamps )
+    /* nothing below this entry can arrive earlier */
+    if( w->cur_pcr < arrival_time( head ) )
+        return pes;
+
+    if( stream->tb.cur_buf == 0.0 && ( !pes || pes_before( w, head, pes ) ) )
+        pes = head;
+
+    pes = find_next_pes( w, program, 2*i+1, pes );
+    return find_next_pes( w, program, 2*i+2, pes );
+}
+
+/* Find the pes which the scheduler prefers out of pes and the video pes which have arrived and whose
+ * transport buffer is empty. Each program has at most one video stream */
+static ts_int_pes_t *find_next_video_pes( ts_writer_t *w, ts_int_pes_t *pes )
+{
+    for( int i = 0; i < w->num_programs; i++ )
     {
-        bs_write( &q, 4, 1 );                      // '0001'
-        write_timestamp( &q, out_pes->dts % mod ); // DTS
+        ts_int_stream_t *stream = w->programs[i]->video_stream;
+        ts_int_pes_t *head = stream ? stream->pes_head : NULL;
+
+        if( head && is_current( w, head ) && w->cur_pcr >= arrival_time( head ) && stream->tb.cur_buf == 0.0 &&
+            ( !pes || pes_before( w, head, pes ) ) )
+            pes = head;
     }
 
-    /* TTX requires extra stuffing */
-    if( stream->stream_format == LIBMPEGTS_DVB_TELETEXT )
+    return pes;
+}
+
+/* Number of packets written before the clock reaches time. Times more than a second ahead are capped */
+static int64_t packets_until( ts_writer_t *w, int64_t time )
+{
+    int64_t packet_time = TS_PACKET_SIZE * 8 * TS_CLOCK;
+    int64_t delta = MIN( time - w->cur_pcr, TS_CLOCK ) * w->ts_muxrate - w->cur_pcr_rem;
+
+    return delta > 0 ? (delta + packet_time - 1) / packet_time : 0;
+}
+
+/* Earliest time the transport buffer of the stream can be empty. Only a bound, it may empty a little later */
+static int64_t tb_empty_time( ts_writer_t *w, ts_int_stream_t *stream )
+{
+    buffer_t *tb = &stream->tb;
+    int64_t num_bytes = (tb->cur_buf + 7) / 8;
+
+    if( !num_bytes || (!tb->last_byte_removal_time && !tb->last_byte_removal_rem) )
+        return w->cur_pcr;
+    if( stream->rx <= 0 )
+        return INT64_MAX;
+
+    return tb->last_byte_removal_time - 1 + (num_bytes * 8 * TS_CLOCK + tb->last_byte_removal_rem) / stream->rx;
+}
+
+/* Number of packets, at least one, which can only be null packets when nothing is writable now.
+ * This runs until the first pes may arrive with an empty transport buffer or the first PCR is due */
+static int64_t null_run_length( ts_writer_t *w )
+{
+    int64_t packet_time = TS_PACKET_SIZE * 8 * TS_CLOCK;
+    int64_t run = INT64_MAX;
+
+    for( int i = 0; i < w->num_programs; i++ )
     {
-        int num_stuffing = 45 - (bs_pos( &q ) >> 3);
-        for( int i = 0; i < num_stuffing; i++ )
-            bs_write( &q, 8, 0xff );
+        ts_int_program_t *program = w->programs[i];
+
+        /* check_pcr becomes true after this many packets */
+        int64_t pcr_left = w->pcr_period * 27000LL * w->ts_muxrate - pcr_margin( w ) -
+                           (w->cur_pcr - (int64_t)program->last_pcr) * w->ts_muxrate - w->cur_pcr_rem;
+        run = MIN( run, pcr_left > 0 ? (pcr_left + packet_time - 1) / packet_time : 0 );
+
+        for( int j = 0; j < program->num_pes_heap; j++ )
+        {
+            ts_int_stream_t *stream = program->pes_heap[j];
+            run = MIN( run, packets_until( w, MAX( arrival_time( stream->pes_head ), tb_empty_time( w, stream ) ) ) );
+        }
+
+        ts_int_stream_t *stream = program->video_stream;
+        if( stream && stream->pes_head && is_current( w, stream->pes_head ) )
+            run = MIN( run, packets_until( w, MAX( arrival_time( stream->pes_head ), tb_empty_time( w, stream ) ) ) );
     }
 
-    bs_flush( &q );
-    total_size = in_frame->size + (bs_pos( &q ) >> 3);
+    return MAX( run, 1 );
+}
 
-    if( stream->stream_format == LIBMPEGTS_VIDEO_MPEG2 || stream->stream_format == LIBMPEGTS_VIDEO_AVC )
-        bs_write( &s, 16, 0 );          // PES_packet_length
-    else if( stream->stream_format == LIBMPEGTS_DVB_TELETEXT )
-        bs_write( &q, 16, 0 );          // PES_packet_length FIXME
-    else
-        bs_write( &s, 16, total_size ); // PES_packet_length
+/**** Scheduling heap ****/
+/* Streams are keyed on the earliest arrival time of the pes at the front of their queue */
+static int64_t pes_heap_key( ts_int_program_t *program, int i )
+{
+    ts_int_stream_t *stream = program->pes_heap[i];
+    return stream->pes_head->dts - stream->max_frame_size;
+}
 
-    write_bytes( &s, temp, bs_pos( &q ) >> 3 );
-    header_size = bs_pos( &s ) >> 3;
-    write_bytes( &s, in_frame->data, in_frame->size );
+static void pes_heap_swap( ts_int_program_t *program, int i, int j )
+{
+    ts_int_stream_t *tmp = program->pes_heap[i];
+    program->pes_heap[i] = program->pes_heap[j];
+    program->pes_heap[j] = tmp;
+    program->pes_heap[i]->heap_pos = i;
+    program->pes_heap[j]->heap_pos = j;
+}
 
-    bs_flush( &s );
+static void pes_heap_push( ts_int_program_t *program, ts_int_stream_t *stream )
+{
+    stream->heap_pos = program->num_pes_heap;
+    program->pes_heap[program->num_pes_heap++] = stream;
+    pes_heap_sift_up( program, stream->heap_pos );
+}
 
-    out_pes->size = out_pes->bytes_left = bs_pos( &s ) >> 3;
-    out_pes->cur_pos = out_pes->data;
+static void pes_heap_remove( ts_int_program_t *program, ts_int_stream_t *stream )
+{
+    int i = stream->heap_pos;
 
-    return header_size;
+    program->num_pes_heap--;
+    if( i == program->num_pes_heap )
+        return;
+
+    program->pes_heap[i] = program->pes_heap[program->num_pes_heap];
+    program->pes_heap[i]->heap_pos = i;
+    pes_heap_sift_up( program, i );
+    pes_heap_sift_down( program, i );
 }
 
-static void write_null_packet( ts_writer_t *w )
+static void pes_heap_sift_up( ts_int_program_t *program, int i )
 {
-    int start;
-    int cc = 0;
+    while( i > 0 && pes_heap_key( program, (i-1) >> 1 ) > pes_heap_key( program, i ) )
+    {
+        pes_heap_swap( program, i, (i-1) >> 1 );
+        i = (i-1) >> 1;
+    }
+}
+
+static void pes_heap_sift_down( ts_int_program_t *program, int i )
+{
+    while( 1 )
+    {
+        int min = i;
+        int left = 2*i+1;
+        int right = 2*i+2;
+
+        if( left < program->num_pes_heap && pes_heap_key( program, left ) < pes_heap_key( program, min ) )
+            min = left;
+        if( right < program->num_pes_heap && pes_heap_key( program, right ) < pes_heap_key( program, min ) )
+            min = right;
+        if( min == i )
+            break;
+
+        pes_heap_swap( program, i, min );
+        i = min;
+    }
+}
 
+/* Write up to num_packets null packets as one copy of a prebuilt packet, stopping where
+ * the packet loop would flush a chunk or run out of output space */
+static void write_null_packets( ts_writer_t *w, int64_t num_packets )
+{
     bs_t *s = &w->out.bs;
-    start = bs_pos( s );
+    packet_cache_t *cache = &w->null_cache;
+    int size = packet_size( w ) - w->out.null_deletion;
+
+    if( !cache->size )
+    {
+        uint8_t *p = cache->data;
+        cache->size = size;
+        memset( p, 0xff, size );
+        if( w->ts_type == TS_TYPE_BLU_RAY )
+        {
+            // tp_extra_header: copy_permission_indicator and arrival_time_stamp FIXME
+            M32( p ) = 0;
+            p += 4;
+        }
+        p[0] = 0x47;                   // sync byte
+        p[1] = (NULL_PID >> 8) & 0x1f; // PID
+        p[2] = NULL_PID & 0xff;
+        p[3] = PAYLOAD_ONLY << 4;      // adaptation_field_control, continuity_counter
+    }
 
-    write_packet_header( w, 0, NULL_PID, PAYLOAD_ONLY, &cc );
-    write_padding( s, start );
+    bs_flush_bytes( s );
 
-    increase_pcr( w, 1 );
+    int64_t space = s->p_end - s->p;
+    if( w->out.user_buffer )
+        num_packets = MIN( num_packets, (space - w->out.reserve) / size + 1 );
+    else
+        num_packets = MIN( num_packets, space / size );
+    if( w->out.write_packets )
+    {
+        int64_t chunk_left = w->out.chunk_packets * size - (bs_pos( s ) >> 3);
+        num_packets = MIN( num_packets, (chunk_left + size - 1) / size );
+    }
+    num_packets = MAX( num_packets, 1 );
+
+    if( w->out.null_deletion )
+    {
+        /* delete up to 255 in a row and keep the next one */
+        num_packets = MIN( num_packets, 256 - w->out.deleted_nulls );
+        w->out.deleted_nulls += num_packets - 1;
+        if( w->out.deleted_nulls == 255 )
+        {
+            write_deleted_count( w );
+            write_bytes( s, cache->data, cache->size );
+            w->deleted_packets += num_packets - 1;
+        }
+        else
+        {
+            w->out.deleted_nulls++;
+            w->deleted_packets += num_packets;
+        }
+
+        w->pid_packets[NULL_PID & 0x1fff] += num_packets;
+        increase_pcr( w, num_packets );
+        return;
+    }
+
+    for( int64_t i = 0; i < num_packets; i++ )
+    {
+        memcpy( s->p, cache->data, size );
+        s->p += size;
+    }
+
+    w->pid_packets[NULL_PID & 0x1fff] += num_packets;
+    increase_pcr( w, num_packets );
 }
 
 ts_int_stream_t *find_stream( ts_writer_t *w, int pid )
 {
-    for( int i = 0; i < w->programs[0]->num_streams; i++ )
-    {
-        if( pid == w->programs[0]->streams[i]->pid )
-            return w->programs[0]->streams[i];
-    }
-    return NULL;
+    if( pid < 0 || pid >= MAX_PIDS )
+        return NULL;
+    return w->pid_map[pid];
 }
@@ -291,10 +291,14 @@ ts_writer_t *ts_create_writer( void );
  *
  * retransmit period in (ms)
  *
+ * Multiple Program Transport Streams must be constant bitrate. All programs share one packet scheduler and clock,
+ * each program gets its own PCR and every PMT is retransmitted with the PAT.
+ * Programs need different PMT PIDs and nonzero program numbers and no PID may be used by more than one stream.
+ *
  * CURRENT LIMITATIONS
  *
- * Single Program Transport Streams only supported currently.
- * Only one video stream allowed.
+ * The PAT must fit in a single packet (up to 42 programs, 41 with a network PID).
+ * Only one video stream allowed per program.
  *
  *
  * */
@@ -593,11 +597,322 @@ typedef struct
 
 int ts_write_frames( ts_writer_t *w, ts_frame_t *frames, int num_frames, uint8_t **out, int *len );
 
-/* 
+/* Scheduling
+ *
+ * A packet can only carry a pes which has arrived (DTS minus max_frame_size) and whose transport buffer is empty.
+ * PCRs which are due go out first. The scheduler picks one of these pes:
+ *
+ * LIBMPEGTS_SCHEDULER_DEFAULT - the non-video pes with the earliest DTS, or else the video pes with the earliest DTS
+ * LIBMPEGTS_SCHEDULER_EDF - the pes with the earliest deadline, video or not. The deadline is the DTS, or the
+ *                           arrival plus the maximum delay of the stream if that is sooner, so a maximum delay
+ *                           raises the priority of the stream.
+ *
+ * At low muxrates the default scheduler can make the video late behind non-video which is due later, whereas EDF
+ * sends the video first. Non-video is sent no faster than its transport buffer leaks though, so when non-video
+ * and video are due close together EDF can make the non-video late where the default scheduler would not.
+ *
+ * ts_set_stream_max_delay sets the maximum delay of the stream on pid, in 90kHz ticks from the arrival of each
+ * frame until its last packet is written. 0 removes it. A pes which ends later is reported as
+ * LIBMPEGTS_DIAG_MAX_DELAY whichever scheduler is used. */
+#define LIBMPEGTS_SCHEDULER_DEFAULT 0
+#define LIBMPEGTS_SCHEDULER_EDF     1
+
+int ts_set_scheduler( ts_writer_t *w, int scheduler );
+int ts_set_stream_max_delay( ts_writer_t *w, int pid, int64_t max_delay );
+
+/* Caller-supplied output
+ *
+ * By default ts_write_frames writes into a buffer owned by libmpegts. It is allocated by ts_setup_transport_stream
+ * to hold one second of output at the muxrate and is never reallocated while muxing, so a call with more output
+ * than that returns LIBMPEGTS_OUTPUT_FULL as described below.
+ * ts_set_output_buffer makes subsequent calls write into buf (of size bytes) instead, and libmpegts
+ * never reallocates it. size must be at least ts_get_min_output_size, which grows with the number of programs
+ * and is LIBMPEGTS_MIN_OUTPUT_SIZE for a single program. Before ts_setup_transport_stream only
+ * LIBMPEGTS_MIN_OUTPUT_SIZE is checked, and ts_setup_transport_stream fails if the buffer is too small.
+ *
+ * When buf has no more room, ts_write_frames stops at a packet boundary and returns LIBMPEGTS_OUTPUT_FULL
+ * with the packets written so far in out/len. Call ts_write_frames again with no frames to carry on writing
+ * from the start of the buffer once its contents have been used, or set another buffer first
+ * (e.g. the next slab of a ring). Passing frames before the output has been completed is an error.
+ *
+ * Set buf to NULL to return to the internal buffer. */
+#define LIBMPEGTS_OUTPUT_FULL 1
+#define LIBMPEGTS_MIN_OUTPUT_SIZE 1536 /* smallest buffer for any stream */
+
+int ts_set_output_buffer( ts_writer_t *w, uint8_t *buf, int size );
+int ts_get_min_output_size( ts_writer_t *w );
+
+/* Streaming output
+ *
+ * ts_set_output_callback makes ts_write_frames pass the packets to write_packets as soon as they are written,
+ * in chunks of chunk_packets packets (188 bytes, or 192 bytes for Blu-ray). The packets left at the end of a call
+ * are passed as a shorter chunk. ts_write_frames then returns a length of 0.
+ * write_packets returns the number of bytes it took, which may be negative if it took none. Taking fewer than len
+ * bytes is a failure and makes ts_write_frames fail. The bytes it did not take are kept: as after
+ * LIBMPEGTS_OUTPUT_FULL, call ts_write_frames without frames until it succeeds to pass them again and finish
+ * the output.
+ * It cannot be combined with ts_set_output_buffer. Set write_packets to NULL to return to the buffer output.
+ *
+ * Two sinks are provided:
+ * ts_write_fd_sink - opaque points to a file descriptor (int)
+ * ts_write_memory_sink - opaque points to a ts_memory_sink_t, initialised to zero. The caller frees data */
+typedef struct
+{
+    uint8_t *data;
+    int size; /* bytes allocated */
+    int len;  /* bytes written */
+} ts_memory_sink_t;
+
+int ts_set_output_callback( ts_writer_t *w, int (*write_packets)( void *opaque, uint8_t *data, int len ),
+                            void *opaque, int chunk_packets );
+int ts_write_fd_sink( void *opaque, uint8_t *data, int len );
+int ts_write_memory_sink( void *opaque, uint8_t *data, int len );
+
+/* Real-time pacing
+ *
+ * ts_set_pacing makes the output callback receive each chunk at its nominal transmission time, when the PCR of
+ * its first packet is due on a CLOCK_MONOTONIC timeline which starts with the first chunk. The chunk size given to
+ * ts_set_output_callback is the burst granularity. ts_write_frames blocks until its packets have been released.
+ * The times are exact in CBR mode; in VBR mode a chunk is released by the time of its last packet.
+ *
+ * enable - 0 disables pacing. Enabling restarts the timeline
+ * spin_ns - wake up this many nanoseconds early and busy-wait until the release time. 0 only sleeps
+ *
+ * ts_get_pacing_stats reports the delay of each release after its nominal time (offset) and the largest
+ * difference between the interval of two consecutive releases and their nominal interval (jitter), in ns. */
+typedef struct
+{
+    int64_t num_bursts;
+    int64_t mean_offset;
+    int64_t max_offset;
+    int64_t max_jitter;
+} ts_pacing_stats_t;
+
+int ts_set_pacing( ts_writer_t *w, int enable, int spin_ns );
+void ts_get_pacing_stats( ts_writer_t *w, ts_pacing_stats_t *stats );
+
+/* Null packet deletion
+ *
+ * ts_set_null_deletion leaves the null packets of a CBR stream out of the output, e.g. for IP delivery. The mux
+ * runs as before so PCRs and buffer levels are those of the CBR stream. Each packet is preceded by one byte with
+ * the number of null packets deleted just before it, so packets take 189 bytes. At most 255 null packets in a row
+ * are deleted; the next one is kept. Null packets at the very end of the stream are lost.
+ * tools/reinsert_nulls.c restores the CBR stream.
+ *
+ * Call it after ts_setup_transport_stream. Blu-ray streams are not supported. */
+int ts_set_null_deletion( ts_writer_t *w, int enable );
+
+/* UDP/RTP sink
+ *
+ * Groups 188-byte packets into datagrams, optionally with an RTP header (RFC 2250), and sends batches of
+ * datagrams with one system call (sendmmsg where available). Pass ts_write_udp_sink to ts_set_output_callback
+ * with the sink as opaque. ts_write_udp_sink fails on data which are not whole packets starting with a sync byte,
+ * so Blu-ray streams and null packet deletion cannot be sent. When sending fails it returns the packets it took
+ * so far, and the datagrams which were sent are not sent again. tools/udp_loopback.c is an example. RTP timestamps are the 90kHz time of the first packet of each datagram, interpolated
+ * from the PCRs of pcr_pid.
+ *
+ * fd - connected UDP socket. It is not closed by the sink
+ * rtp - add an RTP header with rtp_ssrc
+ * pcr_pid - PID whose PCR gives the time of the packets. 0 uses the first PID with a PCR
+ * packets_per_datagram - default 7
+ * batch_size - datagrams sent at once, default 16
+ * datagram_sent - optional, called for each datagram with its time of sending, e.g. to measure pacing
+ *
+ * ts_flush_udp_sink sends the complete datagrams which are waiting for a full batch, e.g. after each call of
+ * ts_write_frames. ts_close_udp_sink also sends the incomplete datagram. */
+typedef struct
+{
+    int64_t seq;       /* datagram number, the RTP sequence number is the lower 16 bits */
+    int size;          /* including the RTP header */
+    int64_t pcr;       /* 27MHz time of the first packet, -1 before the first PCR */
+    int64_t send_time; /* CLOCK_MONOTONIC time in nanoseconds */
+} ts_datagram_info_t;
+
+typedef struct
+{
+    int fd;
+    int rtp;
+    uint32_t rtp_ssrc;
+    int pcr_pid;
+    int packets_per_datagram;
+    int batch_size;
+    void (*datagram_sent)( void *opaque, ts_datagram_info_t *info );
+    void *opaque;
+} ts_udp_sink_params_t;
+
+typedef struct ts_udp_sink_t ts_udp_sink_t;
+
+ts_udp_sink_t *ts_create_udp_sink( ts_udp_sink_params_t *params );
+int ts_write_udp_sink( void *opaque, uint8_t *data, int len );
+int ts_flush_udp_sink( ts_udp_sink_t *sink );
+int ts_close_udp_sink( ts_udp_sink_t *sink );
+
+/* Zero-copy mode
+ *
+ * By default the payload of each frame is copied into libmpegts when it is passed to ts_write_frames.
+ * In zero-copy mode only the PES header is held by libmpegts and the payload is read directly
+ * from ts_frame_t.data as packets are written.
+ *
+ * Frames are written out during subsequent calls to ts_write_frames, so the data of each frame
+ * must remain valid and unmodified until release_frame is called with its ts_frame_t.data pointer.
+ * release_frame is called from within ts_write_frames, or from ts_close_writer for frames which were never written.
+ *
+ * Set release_frame to NULL to return to copying frames. The mode cannot be changed while frames are buffered. */
+int ts_set_zero_copy( ts_writer_t *w, void (*release_frame)( void *opaque, uint8_t *data ), void *opaque );
+
+/* Frame pool statistics
+ *
+ * Buffered frames are held in per-stream pools which are reused once they have been written.
+ * After the mux has warmed up num_allocs should stay constant.
  *
+ * num_allocs - number of memory allocations made for buffered frames
+ * num_reuses - number of frames buffered without allocating
+ * pooled_bytes - memory currently held by free pool entries */
+typedef struct
+{
+    int64_t num_allocs;
+    int64_t num_reuses;
+    int64_t pooled_bytes;
+} ts_pool_stats_t;
+
+void ts_get_pool_stats( ts_writer_t *w, ts_pool_stats_t *stats );
+
+/* Diagnostics
+ * Problems with the input found while muxing are reported as events rather than printed as they happen.
+ *
+ * LIBMPEGTS_DIAG_DTS_BEFORE_PCR - a packet of the pes is written after its DTS. Counted per packet
+ * LIBMPEGTS_DIAG_DTS_AFTER_PTS - a frame has a DTS greater than its PTS. Counted per frame
+ * LIBMPEGTS_DIAG_MAX_DELAY - the pes ends later than the maximum delay of its stream allows. Counted per pes
+ *
+ * ts_set_diag_callback makes the writer call diag for each code at most once per interval of mux time (27MHz ticks),
+ * and for the first event. count is the number of events since the previous call for the code, including this one.
+ * diag is called from the thread calling ts_write_frames and should not block. 0 reports every event.
+ * Set diag to NULL to go back to the default, which prints to stderr. The default interval is one second. */
+#define LIBMPEGTS_DIAG_DTS_BEFORE_PCR 0
+#define LIBMPEGTS_DIAG_DTS_AFTER_PTS  1
+#define LIBMPEGTS_DIAG_MAX_DELAY      2
+#define LIBMPEGTS_DIAG_COUNT          3
+
+typedef struct
+{
+    int code;
+    int pid;
+    int64_t dts; /* 90kHz */
+    int64_t pts;
+    int64_t pcr; /* 27MHz */
+    int64_t count;
+    int64_t total;
+} ts_diag_t;
+
+int ts_set_diag_callback( ts_writer_t *w, void (*diag)( void *opaque, ts_diag_t *diag ), void *opaque, int64_t interval );
+
+/* Mux statistics
+ * Counted since the writer was created. Counting is cheap enough to always be on.
+ *
+ * packets - all packets written
+ * null_packets, psi_packets, pcr_packets - null stuffing, PAT/PMT/SIT and PCR-only packets
+ * deleted_packets - null packets left out by ts_set_null_deletion, counted in packets and null_packets too
+ * stuffing_ratio, psi_overhead - fraction of packets which are null or PSI
+ * diag_events - total events of each diagnostic code
+ * min_pcr_interval, max_pcr_interval - between consecutive PCRs of any program, in 27MHz ticks
+ * num_pids - number of PIDs with packets
+ *
+ * pids receives the statistics of up to max_pids PIDs in ascending order. It can be NULL. bytes are those written
+ * to the output, so they leave out deleted null packets.
+ * pcr intervals are set for PCR PIDs. tb_max is the highest fill of the T-STD transport buffer and
+ * tb_size its size, in bytes, for elementary stream PIDs. The mux only models the transport buffers, so there are
+ * no high-water marks for the multiplex/main and elementary buffers. */
+typedef struct
+{
+    int pid;
+    int64_t packets;
+    int64_t bytes;
+    int64_t min_pcr_interval;
+    int64_t max_pcr_interval;
+    int tb_max;
+    int tb_size;
+} ts_pid_stats_t;
+
+typedef struct
+{
+    int64_t packets;
+    int64_t null_packets;
+    int64_t psi_packets;
+    int64_t pcr_packets;
+    int64_t deleted_packets;
+    double stuffing_ratio;
+    double psi_overhead;
+    int64_t min_pcr_interval;
+    int64_t max_pcr_interval;
+    int num_pids;
+    int64_t diag_events[LIBMPEGTS_DIAG_COUNT]; /* events of each diagnostic code */
+} ts_stats_t;
+
+int ts_get_stats( ts_writer_t *w, ts_stats_t *stats, ts_pid_stats_t *pids, int max_pids );
+
+/* Profiling
+ * When libmpegts is configured with --enable-profile, the writer accumulates the time spent and the number of calls
+ * in each phase of the mux. Otherwise nothing is measured and ts_get_profile fails.
+ *
+ * pes - building the pes of the input frames (run on the packetization threads if enabled)
+ * schedule - choosing the next pes to write
+ * adaptation_field - building adaptation fields, including the PCR
+ * psi - retransmitting the PAT and PMTs
+ * tstd - advancing the clock and draining the T-STD buffers
+ * payload - copying pes data into packets
+ * output - passing packets to the output callback, including waiting for pacing
+ * null_run - skipping ahead when nothing else can be written, i.e. working out the run and writing its null packets
+ *
+ * The phases do not overlap: while one phase runs within another, e.g. the tstd time of the PSI packets, only the
+ * inner one is counted, so the ticks of all phases add up to at most the time spent in libmpegts.
+ * ticks are TSC cycles on x86 and nanoseconds elsewhere.
+ * ts_get_profile fills up to max_phases entries and returns their number.
+ * The profile of a pipelined writer should be read from the thread calling ts_write_frames once ts_queue_frames has returned. */
+typedef struct
+{
+    const char *name;
+    int64_t calls;
+    int64_t ticks;
+} ts_profile_t;
+
+int ts_get_profile( ts_writer_t *w, ts_profile_t *phases, int max_phases );
+void ts_reset_profile( ts_writer_t *w );
+
+/* Delete a stream from the program
+ * Frames of the stream which have not been written yet are dropped and the PMT is updated.
+ * The PCR stream cannot be deleted.
+ * With a pipeline the stream cannot be deleted either. Call ts_set_pipeline( w, 0 ) first, which needs
+ * ts_queue_frames and ts_write_frames to be idle, and enable the pipeline again afterwards.
  * */
 int ts_delete_stream( ts_writer_t *w, int pid );
 
+/* Set the number of threads used to build the PES of a multiple program transport stream
+ * Each program's frames are packetized by one thread; packets are still written in order by the
+ * calling thread so the output is identical to the single threaded output.
+ * threads - number of threads including the calling thread. 1 disables threading (default)
+ * Fails if libmpegts was built without thread support.
+ * */
+int ts_set_threads( ts_writer_t *w, int threads );
+
+/* Pipelined packetization
+ * With a pipeline the PES of the frames are built by ts_queue_frames, which can be called from one thread
+ * (e.g. the encoder's) as frames arrive while another thread calls ts_write_frames without frames.
+ * The two calls only communicate through lock-free queues, so building PES overlaps writing packets.
+ * Other functions must not be called concurrently with ts_queue_frames.
+ *
+ * queue_size - maximum number of built frames which have not been taken by ts_write_frames. 0 disables the pipeline
+ *              It must be at least the number of frames passed to one call of ts_queue_frames
+ * */
+int ts_set_pipeline( ts_writer_t *w, int queue_size );
+
+/* Build the PES of the frames for a later call of ts_write_frames
+ * Each call of ts_write_frames takes the frames of one call of ts_queue_frames, so the output is the same as if
+ * the frames were passed to ts_write_frames directly. ts_write_frames writes nothing while no frames are queued.
+ * Queue no frames to flush the mux at the end of the stream.
+ * Returns 1 if the frames were queued, 0 if the queue is full (nothing is queued and the call can be retried),
+ * or -1 on error */
+int ts_queue_frames( ts_writer_t *w, ts_frame_t *frames, int num_frames );
+
 int ts_close_writer( ts_writer_t *w );
 
 /* Examples TODO */
@@ -0,0 +1,468 @@
+/*****************************************************************************
+ * bench.c : muxer throughput benchmark
+ *****************************************************************************
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *****************************************************************************/
+
+/* Muxes a synthetic stream of 25fps video with audio and subtitle PIDs and reports the throughput of
+ * ts_write_frames. Only the time spent in libmpegts is measured.
+ * --mode packets fixes a workload dominated by writing TS packets: 40 Mbit/s CBR with 30 Mbit/s video and three
+ * audio PIDs. With --mode crc it measures each CRC-32 implementation the CPU can run instead. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "libmpegts.h"
+#include "crc/crc.h"
+
+#define VIDEO_PID       0x100
+#define AUDIO_PID       0x200
+#define SUB_PID         0x300
+#define MAX_AUDIO       8
+#define MAX_SUBS        8
+#define FRAME_DURATION  3600 /* 25fps in 90kHz ticks */
+#define AUDIO_DURATION  2160 /* MPEG audio at 48kHz */
+#define AUDIO_SIZE      576  /* 192kbit/s */
+#define SUB_INTERVAL    50   /* one subtitle every two seconds */
+#define SUB_SIZE        2000
+#define SUB_DELAY       45000 /* sent up to half a second before they are displayed */
+#define VBV_DELAY       90000
+#define CRC_BENCH_BYTES (256 << 20) /* hashed per implementation and size */
+
+enum bench_mode_e
+{
+    BENCH_MODE_MUX,
+    BENCH_MODE_CRC,
+    BENCH_MODE_PACKETS,
+};
+
+typedef struct
+{
+    int frames;
+    int video_bitrate; /* kbit/s */
+    int gop;
+    int audio;
+    int subs;
+    int muxrate;       /* kbit/s */
+    int cbr;
+    int ts_type;
+    int threads;
+    int scheduler;
+    int max_delay;     /* ms */
+    int profile;
+    int mode;
+} bench_opt_t;
+
+static const char * const ts_type_names[] = { "dvb", "cablelabs", "atsc", "isdb", "bluray", NULL };
+static const char * const scheduler_names[] = { "default", "edf", NULL };
+static const char * const mode_names[] = { "mux", "crc", "packets", NULL };
+
+static uint32_t seed = 1;
+
+static int rnd( int n )
+{
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 8) % n;
+}
+
+static int64_t get_time( void )
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void help( void )
+{
+    printf( "Usage: bench [options]\n"
+            "  --mode <string>        mux, crc, packets [mux]\n"
+            "  --frames <int>         Video frames to mux [1500]\n"
+            "  --video-bitrate <int>  Average video bitrate in kbit/s [8000]\n"
+            "  --gop <int>            GOP length [25]\n"
+            "  --audio <int>          Number of audio PIDs [2]\n"
+            "  --subtitles <int>      Number of subtitle PIDs [1]\n"
+            "  --muxrate <int>        Muxrate in kbit/s [12000]\n"
+            "  --vbr                  Variable bitrate\n"
+            "  --ts-type <string>     dvb, cablelabs, atsc, isdb, bluray [dvb]\n"
+            "  --threads <int>        Packetization threads [0]\n"
+            "  --scheduler <string>   default, edf [default]\n"
+            "  --max-delay <int>      Maximum delay of the audio PIDs in ms [0]\n"
+            "  --profile              Show the time of each phase (needs --enable-profile)\n" );
+}
+
+static int parse_ts_type( const char *name )
+{
+    for( int i = 0; ts_type_names[i]; i++ )
+        if( !strcmp( name, ts_type_names[i] ) )
+            return TS_TYPE_DVB + i;
+    return -1;
+}
+
+static int parse_scheduler( const char *name )
+{
+    for( int i = 0; scheduler_names[i]; i++ )
+        if( !strcmp( name, scheduler_names[i] ) )
+            return LIBMPEGTS_SCHEDULER_DEFAULT + i;
+    return -1;
+}
+
+static int parse_mode( const char *name )
+{
+    for( int i = 0; mode_names[i]; i++ )
+        if( !strcmp( name, mode_names[i] ) )
+            return BENCH_MODE_MUX + i;
+    return -1;
+}
+
+static int parse_options( int argc, char **argv, bench_opt_t *opt )
+{
+    static const struct option long_options[] =
+    {
+        { "frames",        required_argument, NULL, 'f' },
+        { "video-bitrate", required_argument, NULL, 'b' },
+        { "gop",           required_argument, NULL, 'g' },
+        { "audio",         required_argument, NULL, 'a' },
+        { "subtitles",     required_argument, NULL, 's' },
+        { "muxrate",       required_argument, NULL, 'm' },
+        { "vbr",           no_argument,       NULL, 'v' },
+        { "ts-type",       required_argument, NULL, 't' },
+        { "threads",       required_argument, NULL, 'T' },
+        { "scheduler",     required_argument, NULL, 'S' },
+        { "max-delay",     required_argument, NULL, 'd' },
+        { "profile",       no_argument,       NULL, 'p' },
+        { "mode",          required_argument, NULL, 'M' },
+        { "help",          no_argument,       NULL, 'h' },
+        { 0 }
+    };
+    int c;
+
+    opt->frames = 1500;
+    opt->video_bitrate = 8000;
+    opt->gop = 25;
+    opt->audio = 2;
+    opt->subs = 1;
+    opt->muxrate = 12000;
+    opt->cbr = 1;
+    opt->ts_type = TS_TYPE_DVB;
+    opt->threads = 0;
+    opt->scheduler = LIBMPEGTS_SCHEDULER_DEFAULT;
+    opt->max_delay = 0;
+    opt->profile = 0;
+    opt->mode = BENCH_MODE_MUX;
+
+    while( (c = getopt_long( argc, argv, "h", long_options, NULL )) != -1 )
+    {
+        switch( c )
+        {
+            case 'f': opt->frames = atoi( optarg ); break;
+            case 'b': opt->video_bitrate = atoi( optarg ); break;
+            case 'g': opt->gop = atoi( optarg ); break;
+            case 'a': opt->audio = atoi( optarg ); break;
+            case 's': opt->subs = atoi( optarg ); break;
+            case 'm': opt->muxrate = atoi( optarg ); break;
+            case 'v': opt->cbr = 0; break;
+            case 't': opt->ts_type = parse_ts_type( optarg ); break;
+            case 'T': opt->threads = atoi( optarg ); break;
+            case 'S': opt->scheduler = parse_scheduler( optarg ); break;
+            case 'd': opt->max_delay = atoi( optarg ); break;
+            case 'p': opt->profile = 1; break;
+            case 'M': opt->mode = parse_mode( optarg ); break;
+            default:
+                help();
+                return -1;
+        }
+    }
+
+    if( opt->frames <= 0 || opt->video_bitrate <= 0 || opt->gop <= 0 || opt->audio < 0 || opt->audio > MAX_AUDIO ||
+        opt->subs < 0 || opt->subs > MAX_SUBS || opt->muxrate <= 0 || opt->ts_type < 0 || opt->threads < 0 ||
+        opt->scheduler < 0 || opt->max_delay < 0 || opt->mode < 0 )
+    {
+        fprintf( stderr, "Invalid options\n" );
+        return -1;
+    }
+
+    /* only DVB subtitles can be set up */
+    if( opt->ts_type == TS_TYPE_BLU_RAY && opt->subs )
+    {
+        fprintf( stderr, "Subtitles are not supported in Blu-Ray, use --subtitles 0\n" );
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Throughput of each CRC-32 implementation at section and larger sizes */
+static int bench_crc( void )
+{
+    static const int sizes[] = { 180, 1024, 4096, 65536 };
+    crc_impl_t impls[CRC_MAX_IMPLS];
+    int num_impls = crc_32_impls( impls );
+    uint8_t *data = malloc( 65536 );
+    volatile uint32_t sink = 0;
+
+    if( !data )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        return -1;
+    }
+
+    for( int i = 0; i < 65536; i++ )
+        data[i] = rnd( 256 );
+
+    printf( "%8s", "bytes" );
+    for( int i = 0; i < num_impls; i++ )
+        printf( " %10s", impls[i].name );
+    printf( "  (MB/s)\n" );
+
+    for( int s = 0; s < sizeof(sizes) / sizeof(*sizes); s++ )
+    {
+        int reps = CRC_BENCH_BYTES / sizes[s];
+        printf( "%8i", sizes[s] );
+        for( int i = 0; i < num_impls; i++ )
+        {
+            uint32_t crc = 0;
+            int64_t start = get_time();
+            for( int r = 0; r < reps; r++ )
+                crc ^= impls[i].func( data, sizes[s] );
+            int64_t time = get_time() - start;
+            sink ^= crc;
+            printf( " %10.0f", (double)reps * sizes[s] * 1e3 / time );
+        }
+        printf( "\n" );
+    }
+
+    free( data );
+    return 0;
+}
+
+static int setup_writer( ts_writer_t *w, bench_opt_t *opt )
+{
+    ts_stream_t streams[1 + MAX_AUDIO + MAX_SUBS];
+    int num_streams = 0;
+
+    memset( streams, 0, sizeof(streams) );
+
+    streams[num_streams].pid = VIDEO_PID;
+    streams[num_streams].stream_format = LIBMPEGTS_VIDEO_AVC;
+    streams[num_streams].stream_id = LIBMPEGTS_STREAM_ID_MPEGVIDEO;
+    streams[num_streams].max_frame_size = VBV_DELAY;
+    num_streams++;
+
+    for( int i = 0; i < opt->audio; i++ )
+    {
+        streams[num_streams].pid = AUDIO_PID + i;
+        streams[num_streams].stream_format = LIBMPEGTS_AUDIO_MPEG2;
+        streams[num_streams].stream_id = LIBMPEGTS_STREAM_ID_MPEGAUDIO + i;
+        streams[num_streams].max_frame_size = AUDIO_DURATION;
+        num_streams++;
+    }
+
+    for( int i = 0; i < opt->subs; i++ )
+    {
+        streams[num_streams].pid = SUB_PID + i;
+        streams[num_streams].stream_format = LIBMPEGTS_DVB_SUB;
+        streams[num_streams].stream_id = LIBMPEGTS_STREAM_ID_PRIVATE_1;
+        streams[num_streams].max_frame_size = SUB_DELAY;
+        num_streams++;
+    }
+
+    ts_program_t program =
+    {
+        .pmt_pid = 0x42,
+        .program_num = 1,
+        .pcr_pid = VIDEO_PID,
+        .num_streams = num_streams,
+        .streams = streams,
+    };
+
+    ts_main_t params =
+    {
+        .num_programs = 1,
+        .programs = &program,
+        .ts_id = 1,
+        .muxrate = opt->muxrate * 1000,
+        .cbr = opt->cbr,
+        .ts_type = opt->ts_type,
+    };
+
+    if( ts_setup_transport_stream( w, &params ) < 0 )
+        return -1;
+
+    /* one second vbv buffer, matching VBV_DELAY */
+    int level = opt->video_bitrate > 20000 ? 41 : 40;
+    if( ts_setup_mpegvideo_stream( w, VIDEO_PID, level, AVC_HIGH, opt->video_bitrate * 1000, opt->video_bitrate * 1000, 0 ) < 0 )
+        return -1;
+
+    ts_dvb_sub_t sub = { .lang_code = "eng", .subtitling_type = LIBMPEGTS_DVB_SUB_TYPE_NORMAL_NO_AR, .composition_page_id = 1, .ancillary_page_id = 1 };
+    for( int i = 0; i < opt->subs; i++ )
+        if( setup_dvb_subtitles( w, SUB_PID + i, 0, 1, &sub ) < 0 )
+            return -1;
+
+    if( opt->threads && ts_set_threads( w, opt->threads ) < 0 )
+        return -1;
+
+    if( ts_set_scheduler( w, opt->scheduler ) < 0 )
+        return -1;
+    for( int i = 0; i < opt->audio; i++ )
+        if( ts_set_stream_max_delay( w, AUDIO_PID + i, opt->max_delay * 90LL ) < 0 )
+            return -1;
+
+    return 0;
+}
+
+int main( int argc, char **argv )
+{
+    bench_opt_t opt;
+    ts_frame_t frames[1 + MAX_AUDIO * 2 + MAX_SUBS];
+    int64_t audio_dts[MAX_AUDIO];
+    int64_t mux_time = 0, packets = 0, input_frames = 0;
+    int ret = 1;
+
+    if( parse_options( argc, argv, &opt ) < 0 )
+        return 1;
+
+    if( opt.mode == BENCH_MODE_CRC )
+        return bench_crc() < 0;
+
+    /* keeps --frames, --ts-type, --threads and --profile */
+    if( opt.mode == BENCH_MODE_PACKETS )
+    {
+        opt.muxrate = 40000;
+        opt.cbr = 1;
+        opt.video_bitrate = 30000;
+        opt.audio = 3;
+        opt.subs = 0;
+    }
+
+    /* I frames are five times the size of the others */
+    int frame_size = opt.video_bitrate * 1000LL / 8 * FRAME_DURATION / 90000;
+    int p_size = frame_size * opt.gop / (opt.gop + 4);
+    int i_size = p_size * 5;
+    int data_size = i_size + p_size > SUB_SIZE ? i_size + p_size : SUB_SIZE;
+
+    uint8_t *data = malloc( data_size );
+    ts_writer_t *w = ts_create_writer();
+    if( !data || !w )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        goto end;
+    }
+
+    for( int i = 0; i < data_size; i++ )
+        data[i] = rnd( 256 );
+
+    if( setup_writer( w, &opt ) < 0 )
+        goto end;
+
+    for( int i = 0; i < opt.audio; i++ )
+        audio_dts[i] = 90000;
+
+    for( int f = 0; f < opt.frames; f++ )
+    {
+        int64_t dts = 90000 + f * (int64_t)FRAME_DURATION;
+        int n = 0;
+
+        memset( frames, 0, sizeof(frames) );
+
+        frames[n].pid = VIDEO_PID;
+        frames[n].data = data;
+        frames[n].random_access = !(f % opt.gop);
+        frames[n].size = frames[n].random_access ? i_size : p_size / 2 + rnd( p_size );
+        frames[n].dts = dts;
+        frames[n].pts = dts + 2 * FRAME_DURATION;
+        frames[n].frame_type = frames[n].random_access ? LIBMPEGTS_CODING_TYPE_SLICE_IDR : LIBMPEGTS_CODING_TYPE_SLICE_P;
+        n++;
+
+        for( int i = 0; i < opt.audio; i++ )
+        {
+            for( ; audio_dts[i] <= dts; audio_dts[i] += AUDIO_DURATION, n++ )
+            {
+                frames[n].pid = AUDIO_PID + i;
+                frames[n].data = data;
+                frames[n].size = AUDIO_SIZE;
+                frames[n].dts = frames[n].pts = audio_dts[i];
+            }
+        }
+
+        if( !(f % SUB_INTERVAL) )
+        {
+            for( int i = 0; i < opt.subs; i++, n++ )
+            {
+                frames[n].pid = SUB_PID + i;
+                frames[n].data = data;
+                frames[n].size = SUB_SIZE;
+                frames[n].dts = frames[n].pts = dts + SUB_DELAY;
+            }
+        }
+
+        /* the output buffer holds a second of output, a call with more carries on without frames */
+        int ret = LIBMPEGTS_OUTPUT_FULL;
+        for( int i = 0; ret == LIBMPEGTS_OUTPUT_FULL; i++ )
+        {
+            uint8_t *out;
+            int len;
+            int64_t start = get_time();
+            ret = ts_write_frames( w, i ? NULL : frames, i ? 0 : n, &out, &len );
+            if( ret < 0 )
+                goto end;
+            mux_time += get_time() - start;
+
+            packets += len / (opt.ts_type == TS_TYPE_BLU_RAY ? 192 : 188);
+        }
+        input_frames += n;
+    }
+
+    ts_pool_stats_t pool;
+    ts_stats_t stats;
+    struct rusage usage;
+
+    ts_get_pool_stats( w, &pool );
+    ts_get_stats( w, &stats, NULL, 0 );
+    getrusage( RUSAGE_SELF, &usage );
+
+    printf( "ts_type: %s  %s %i kbit/s  video %i kbit/s gop %i  audio %i  subtitles %i  threads %i  scheduler %s\n",
+            ts_type_names[opt.ts_type - TS_TYPE_DVB], opt.cbr ? "cbr" : "vbr", opt.muxrate, opt.video_bitrate, opt.gop,
+            opt.audio, opt.subs, opt.threads, scheduler_names[opt.scheduler] );
+    printf( "frames: %"PRId64"  packets: %"PRId64"  time: %.3f s\n", input_frames, packets, mux_time / 1e9 );
+    printf( "packets/s: %.0f  ns/packet: %.1f\n", packets * 1e9 / mux_time, (double)mux_time / packets );
+    printf( "allocations/frame: %.4f  peak rss: %li kB\n", (double)pool.num_allocs / input_frames, usage.ru_maxrss );
+    printf( "late packets: %"PRId64"  frames over the maximum delay: %"PRId64"\n",
+            stats.diag_events[LIBMPEGTS_DIAG_DTS_BEFORE_PCR], stats.diag_events[LIBMPEGTS_DIAG_MAX_DELAY] );
+
+    if( opt.profile )
+    {
+        ts_profile_t phases[16];
+        int num_phases = ts_get_profile( w, phases, 16 );
+        for( int i = 0; i < num_phases; i++ )
+            printf( "%-16s %10"PRId64" calls %14"PRId64" ticks %8.1f ticks/call %8.1f ticks/packet\n", phases[i].name,
+                    phases[i].calls, phases[i].ticks, phases[i].calls ? (double)phases[i].ticks / phases[i].calls : 0,
+                    (double)phases[i].ticks / packets );
+    }
+
+    ret = 0;
+
+end:
+    if( w )
+        ts_close_writer( w );
+    free( data );
+
+    return ret;
+}
@@ -0,0 +1,480 @@
+/*****************************************************************************
+ * crosscheck.c : cross-checks of the optimised code paths against simple references
+ *****************************************************************************
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *****************************************************************************/
+
+/* Links against the internals of libmpegts.a. Each check runs the library code next to a slow but obviously
+ * correct model and stops at the first difference, except edf which checks the EDF scheduler against the
+ * default one. */
+
+#include <inttypes.h>
+#include <getopt.h>
+
+#include "common.h"
+#include "crc/crc.h"
+
+#define MAX_BUFFERS 8
+#define CRC_MAX_LENGTH 4096
+
+#define EDF_FRAMES      250
+#define EDF_MUXRATE     5000000
+#define EDF_VIDEO_SIZE  10000
+#define EDF_VIDEO_DELAY 1800 /* 90kHz */
+#define EDF_LONG_VIDEO_DELAY 2700
+#define EDF_AUDIO       6
+#define EDF_AUDIO_SIZE  1000
+#define EDF_AUDIO_LEAD  1800
+#define EDF_MAX_DELAY   1500
+
+typedef struct
+{
+    const char *name;
+    buffer_t *buffer;
+    int rx;
+
+    /* per-byte model: time of the last byte removal in units of 1/rx ticks */
+    __int128 removal;
+    int64_t cur_buf;
+} ref_buffer_t;
+
+static uint32_t seed = 1;
+
+static int rnd( int n )
+{
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 8) % n;
+}
+
+/* The T-STD leaky bucket as it was first written: remove one byte every 8/rx seconds while the removal
+ * is strictly before next_pcr. All times are exact rationals. */
+static void ref_drip( ts_writer_t *w, ref_buffer_t *ref, int64_t cur_pcr, int64_t cur_pcr_rem,
+                      int64_t next_pcr, int64_t next_pcr_rem )
+{
+    if( ref->removal == 0 )
+    {
+        ref->removal = (__int128)cur_pcr * ref->rx + (ref->rx > 0 ? cur_pcr_rem * ref->rx / w->ts_muxrate : 0);
+        ref->cur_buf -= 8;
+    }
+
+    if( ref->rx > 0 )
+    {
+        /* compare in units of 1/(rx*ts_muxrate) ticks */
+        __int128 end = ((__int128)next_pcr * w->ts_muxrate + next_pcr_rem) * ref->rx;
+        while( (ref->removal + 8 * TS_CLOCK) * w->ts_muxrate < end )
+        {
+            ref->removal += 8 * TS_CLOCK;
+            ref->cur_buf -= 8;
+        }
+    }
+
+    ref->cur_buf = MAX( ref->cur_buf, 0 );
+}
+
+static int check_tstd_muxrate( int muxrate, int64_t start, int seconds )
+{
+    ts_writer_t *w = ts_create_writer();
+    ts_stream_t streams[3];
+    ref_buffer_t refs[MAX_BUFFERS];
+    int num_refs = 0, ret = -1;
+
+    if( !w )
+        return -1;
+
+    memset( streams, 0, sizeof(streams) );
+    streams[0].pid = 0x100;
+    streams[0].stream_format = LIBMPEGTS_VIDEO_AVC;
+    streams[0].stream_id = LIBMPEGTS_STREAM_ID_MPEGVIDEO;
+    streams[1].pid = 0x101;
+    streams[1].stream_format = LIBMPEGTS_AUDIO_MPEG2;
+    streams[1].stream_id = LIBMPEGTS_STREAM_ID_MPEGAUDIO;
+    streams[2].pid = 0x102;
+    streams[2].stream_format = LIBMPEGTS_AUDIO_ADTS;
+    streams[2].stream_id = LIBMPEGTS_STREAM_ID_MPEGAUDIO + 1;
+    for( int i = 0; i < 3; i++ )
+        streams[i].max_frame_size = 100000;
+
+    ts_program_t program = { .pmt_pid = 0x20, .program_num = 1, .pcr_pid = 0x100, .num_streams = 3, .streams = streams };
+    ts_main_t params = { .num_programs = 1, .programs = &program, .ts_id = 1, .muxrate = muxrate, .cbr = 1,
+                         .ts_type = TS_TYPE_DVB };
+
+    if( ts_setup_transport_stream( w, &params ) < 0 ||
+        ts_setup_mpegvideo_stream( w, 0x100, 41, AVC_HIGH, 20000, 25000, 0 ) < 0 ||
+        ts_setup_mpeg4_aac_stream( w, 0x102, LIBMPEGTS_MPEG4_AAC_MAIN_PROFILE_LEVEL_2, 2 ) < 0 )
+        goto end;
+
+    refs[num_refs++] = (ref_buffer_t){ .name = "system", .buffer = &w->tb, .rx = w->rx_sys };
+    for( int i = 0; i < w->programs[0]->num_streams; i++ )
+    {
+        ts_int_stream_t *stream = w->programs[0]->streams[i];
+        refs[num_refs++] = (ref_buffer_t){ .name = "stream", .buffer = &stream->tb, .rx = stream->rx };
+    }
+
+    for( int i = 0; i < num_refs; i++ )
+        refs[i].cur_buf = refs[i].buffer->cur_buf;
+
+    /* pretend the mux has been running for a while */
+    w->cur_pcr = start;
+
+    int64_t end = start + seconds * TS_CLOCK, steps = 0;
+    while( w->cur_pcr < end )
+    {
+        /* packets arrive one at a time; runs of null packets and vbr gaps move the clock further */
+        int r = rnd( 1000 ), num_packets = r < 950 ? 1 : r < 999 ? 1 + rnd( 100 ) : 1 + rnd( 20000 );
+        int64_t cur_pcr = w->cur_pcr, cur_pcr_rem = w->cur_pcr_rem;
+
+        if( r < 950 )
+        {
+            ref_buffer_t *ref = &refs[rnd( num_refs )];
+            if( ref->buffer->cur_buf + TS_PACKET_SIZE * 8 <= ref->buffer->buf_size )
+            {
+                ref->buffer->cur_buf += TS_PACKET_SIZE * 8;
+                ref->cur_buf += TS_PACKET_SIZE * 8;
+            }
+        }
+
+        /* now and then put a byte removal within a tick of the end of the step, where rounding goes wrong */
+        if( rnd( 20 ) == 0 )
+        {
+            ref_buffer_t *ref = &refs[rnd( num_refs )];
+            int64_t next_pcr_rem = cur_pcr_rem + (int64_t)num_packets * TS_PACKET_SIZE * 8 * TS_CLOCK;
+            int64_t next_pcr = cur_pcr + next_pcr_rem / w->ts_muxrate;
+            next_pcr_rem %= w->ts_muxrate;
+            __int128 next = (__int128)next_pcr * ref->rx + (__int128)next_pcr_rem * ref->rx / w->ts_muxrate;
+            __int128 removal = next - (1 + rnd( 3 )) * 8 * TS_CLOCK + rnd( 3 ) - 1;
+            if( ref->rx > 0 && ref->removal && removal > 0 )
+            {
+                ref->removal = removal;
+                ref->buffer->last_byte_removal_time = removal / ref->rx;
+                ref->buffer->last_byte_removal_rem = removal % ref->rx;
+            }
+        }
+
+        increase_pcr( w, num_packets );
+        steps++;
+
+        for( int i = 0; i < num_refs; i++ )
+        {
+            ref_buffer_t *ref = &refs[i];
+            buffer_t *b = ref->buffer;
+            ref_drip( w, ref, cur_pcr, cur_pcr_rem, w->cur_pcr, w->cur_pcr_rem );
+
+            __int128 removal = (__int128)b->last_byte_removal_time * ref->rx + b->last_byte_removal_rem;
+            if( b->cur_buf != ref->cur_buf || (ref->rx > 0 && removal != ref->removal) )
+            {
+                fprintf( stderr, "tstd: muxrate %i, %s buffer %i (rx %i) differs after %"PRId64" steps at pcr %"PRId64
+                         ": fill %i, expected %"PRId64"\n", muxrate, ref->name, i, ref->rx, steps, w->cur_pcr,
+                         b->cur_buf, ref->cur_buf );
+                goto end;
+            }
+        }
+    }
+
+    printf( "tstd: muxrate %i from %"PRId64"s ok, %"PRId64" steps\n", muxrate, (int64_t)(start / TS_CLOCK), steps );
+    ret = 0;
+
+end:
+    ts_close_writer( w );
+    return ret;
+}
+
+/* The closed-form drain in drip_buffer against the per-byte model it replaced */
+static int check_tstd( int seconds )
+{
+    /* odd muxrates leave a remainder on every packet */
+    static const int muxrates[] = { 1500000, 9000001, 19392658, 38000000, 80000000 };
+
+    /* from the start and past the 33-bit wrap of the 90kHz clock after 26.5 hours */
+    for( int i = 0; i < sizeof(muxrates) / sizeof(*muxrates); i++ )
+        if( check_tstd_muxrate( muxrates[i], 0, seconds ) < 0 ||
+            check_tstd_muxrate( muxrates[i], 27 * 3600 * TS_CLOCK + 12345, seconds ) < 0 )
+            return -1;
+
+    return 0;
+}
+
+static void ignore_diag( void *opaque, ts_diag_t *diag )
+{
+}
+
+/* Mux EDF_FRAMES video frames at a tight muxrate. The video frame and the audio frames passed with it arrive
+ * together, video_delay before the video is due, and the audio is due EDF_AUDIO_LEAD after the video.
+ * Returns the late packets and the pes over the maximum delay in events */
+static int mux_edf_stream( int scheduler, int video_delay, int64_t max_delay, int64_t *events )
+{
+    ts_writer_t *w = ts_create_writer();
+    ts_stream_t streams[1 + EDF_AUDIO];
+    uint8_t *data = calloc( 1, EDF_VIDEO_SIZE );
+    int ret = -1;
+
+    if( !w || !data )
+        goto end;
+
+    memset( streams, 0, sizeof(streams) );
+    streams[0].pid = 0x100;
+    streams[0].stream_format = LIBMPEGTS_VIDEO_AVC;
+    streams[0].stream_id = LIBMPEGTS_STREAM_ID_MPEGVIDEO;
+    streams[0].max_frame_size = video_delay;
+    for( int i = 1; i <= EDF_AUDIO; i++ )
+    {
+        streams[i].pid = 0x100 + i;
+        streams[i].stream_format = LIBMPEGTS_AUDIO_MPEG2;
+        streams[i].stream_id = LIBMPEGTS_STREAM_ID_MPEGAUDIO + i;
+        streams[i].max_frame_size = video_delay + EDF_AUDIO_LEAD;
+    }
+
+    ts_program_t program = { .pmt_pid = 0x20, .program_num = 1, .pcr_pid = 0x100, .num_streams = 1 + EDF_AUDIO,
+                             .streams = streams };
+    ts_main_t params = { .num_programs = 1, .programs = &program, .ts_id = 1, .muxrate = EDF_MUXRATE, .cbr = 1,
+                         .ts_type = TS_TYPE_DVB };
+
+    if( ts_setup_transport_stream( w, &params ) < 0 ||
+        ts_setup_mpegvideo_stream( w, 0x100, 40, AVC_HIGH, 20000000, 20000000 / 90000 * video_delay, 0 ) < 0 ||
+        ts_set_scheduler( w, scheduler ) < 0 ||
+        ts_set_diag_callback( w, ignore_diag, NULL, TS_CLOCK ) < 0 )
+        goto end;
+
+    for( int i = 1; i <= EDF_AUDIO; i++ )
+        if( ts_set_stream_max_delay( w, 0x100 + i, max_delay ) < 0 )
+            goto end;
+
+    for( int f = 0; f < EDF_FRAMES; f++ )
+    {
+        ts_frame_t frames[1 + EDF_AUDIO];
+        int64_t dts = 90000 + f * 3600LL;
+
+        memset( frames, 0, sizeof(frames) );
+        for( int i = 0; i <= EDF_AUDIO; i++ )
+        {
+            frames[i].pid = 0x100 + i;
+            frames[i].data = data;
+            frames[i].size = i ? EDF_AUDIO_SIZE : EDF_VIDEO_SIZE;
+            frames[i].dts = frames[i].pts = i ? dts + EDF_AUDIO_LEAD : dts;
+        }
+        frames[0].random_access = !(f % 25);
+
+        uint8_t *out;
+        int len;
+        int write_ret = ts_write_frames( w, frames, 1 + EDF_AUDIO, &out, &len );
+        while( write_ret == LIBMPEGTS_OUTPUT_FULL )
+            write_ret = ts_write_frames( w, NULL, 0, &out, &len );
+        if( write_ret < 0 )
+            goto end;
+    }
+
+    ts_stats_t stats;
+    if( ts_get_stats( w, &stats, NULL, 0 ) < 0 )
+        goto end;
+    events[0] = stats.diag_events[LIBMPEGTS_DIAG_DTS_BEFORE_PCR];
+    events[1] = stats.diag_events[LIBMPEGTS_DIAG_MAX_DELAY];
+    ret = 0;
+
+end:
+    if( w )
+        ts_close_writer( w );
+    free( data );
+    return ret;
+}
+
+/* The default scheduler sends the non-video first and makes the video late. EDF must send the video first and
+ * meet every DTS. With a longer video delay it must send the audio first instead to meet its maximum delay */
+static int check_edf( void )
+{
+    int64_t def[2], edf[2], edf_delay[2];
+
+    if( mux_edf_stream( LIBMPEGTS_SCHEDULER_DEFAULT, EDF_VIDEO_DELAY, 0, def ) < 0 ||
+        mux_edf_stream( LIBMPEGTS_SCHEDULER_EDF, EDF_VIDEO_DELAY, 0, edf ) < 0 ||
+        mux_edf_stream( LIBMPEGTS_SCHEDULER_EDF, EDF_LONG_VIDEO_DELAY, EDF_MAX_DELAY, edf_delay ) < 0 )
+    {
+        fprintf( stderr, "edf: mux failed\n" );
+        return -1;
+    }
+
+    if( !def[0] )
+    {
+        fprintf( stderr, "edf: the muxrate is not tight, the default scheduler has no late packets\n" );
+        return -1;
+    }
+    if( edf[0] || edf[1] || edf_delay[0] || edf_delay[1] )
+    {
+        fprintf( stderr, "edf: %"PRId64" late packets and %"PRId64" pes over the maximum delay, %"PRId64" and "
+                 "%"PRId64" with a maximum delay\n", edf[0], edf[1], edf_delay[0], edf_delay[1] );
+        return -1;
+    }
+
+    printf( "edf: no late packets, %"PRId64" with the default scheduler\n", def[0] );
+    return 0;
+}
+
+/* CRC-32/MPEG-2 one bit at a time */
+static uint32_t ref_crc_32( uint8_t *bytes, int length )
+{
+    uint32_t crc = 0xffffffff;
+
+    for( int i = 0; i < length; i++ )
+    {
+        crc ^= (uint32_t)bytes[i] << 24;
+        for( int j = 0; j < 8; j++ )
+            crc = crc & 0x80000000 ? (crc << 1) ^ 0x04c11db7 : crc << 1;
+    }
+
+    return crc;
+}
+
+static int check_crc_buffer( crc_impl_t *impls, int num_impls, uint8_t *bytes, int length, int offset )
+{
+    uint32_t ref = ref_crc_32( bytes, length );
+
+    for( int i = 0; i <= num_impls; i++ )
+    {
+        const char *name = i < num_impls ? impls[i].name : "crc_32";
+        uint32_t crc = i < num_impls ? impls[i].func( bytes, length ) : crc_32( bytes, length );
+        if( crc != ref )
+        {
+            fprintf( stderr, "crc: %s gives %08"PRIx32" instead of %08"PRIx32" for %i bytes at offset %i\n",
+                     name, crc, ref, length, offset );
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Every CRC implementation the CPU can run against the bitwise definition */
+static int check_crc( int iterations )
+{
+    crc_impl_t impls[CRC_MAX_IMPLS];
+    int num_impls = crc_32_impls( impls );
+    uint8_t *buf = malloc( CRC_MAX_LENGTH + 64 );
+    int ret = -1;
+
+    if( !buf )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        return -1;
+    }
+
+    if( ref_crc_32( (uint8_t*)"123456789", 9 ) != 0x0376e6e7 )
+    {
+        fprintf( stderr, "crc: wrong check value of the reference\n" );
+        goto end;
+    }
+    memcpy( buf, "123456789", 9 );
+    if( check_crc_buffer( impls, num_impls, buf, 9, 0 ) < 0 )
+        goto end;
+
+    /* every length across the 8 and 64 byte steps at every alignment of a 16 byte load */
+    for( int i = 0; i < CRC_MAX_LENGTH + 64; i++ )
+        buf[i] = rnd( 256 );
+    for( int offset = 0; offset < 16; offset++ )
+        for( int length = 0; length <= 300; length++ )
+            if( check_crc_buffer( impls, num_impls, buf + offset, length, offset ) < 0 )
+                goto end;
+
+    /* random data, lengths and alignments, mostly section sized */
+    for( int n = 0; n < iterations; n++ )
+    {
+        int offset = rnd( 64 ), length = rnd( 4 ) ? rnd( 1024 ) : rnd( CRC_MAX_LENGTH + 1 );
+        int fill = rnd( 8 ); /* runs of 0x00 and 0xff as in padding and stuffing */
+        for( int i = 0; i < length; i++ )
+            buf[offset + i] = fill == 0 ? 0 : fill == 1 ? 0xff : rnd( 256 );
+        if( check_crc_buffer( impls, num_impls, buf + offset, length, offset ) < 0 )
+            goto end;
+    }
+
+    printf( "crc:" );
+    for( int i = 0; i < num_impls; i++ )
+        printf( " %s", impls[i].name );
+    printf( " ok\n" );
+    ret = 0;
+
+end:
+    free( buf );
+    return ret;
+}
+
+static int is_check( const char *name )
+{
+    return !strcmp( name, "tstd" ) || !strcmp( name, "crc" ) || !strcmp( name, "edf" );
+}
+
+static int selected( int argc, char **argv, const char *name )
+{
+    if( optind == argc )
+        return 1;
+    for( int i = optind; i < argc; i++ )
+        if( !strcmp( argv[i], name ) )
+            return 1;
+    return 0;
+}
+
+static void help( void )
+{
+    printf( "Usage: crosscheck [options] [tstd] [crc] [edf]\n"
+            "Runs all checks by default\n"
+            "  --seconds <int>        Stream time of each long-run check [30]\n"
+            "  --seed <int>           Random seed [1]\n" );
+}
+
+int main( int argc, char **argv )
+{
+    int seconds = 30;
+
+    static const struct option long_options[] =
+    {
+        { "seconds", required_argument, NULL, 's' },
+        { "seed",    required_argument, NULL, 'r' },
+        { "help",    no_argument,       NULL, 'h' },
+        { 0, 0, 0, 0 }
+    };
+
+    int c;
+    while( (c = getopt_long( argc, argv, "h", long_options, NULL )) != -1 )
+    {
+        switch( c )
+        {
+            case 's':
+                seconds = atoi( optarg );
+                break;
+            case 'r':
+                seed = atoi( optarg );
+                break;
+            default:
+                help();
+                return c == 'h' ? 0 : 1;
+        }
+    }
+
+    int failed = 0;
+    for( int i = optind; i < argc; i++ )
+    {
+        if( !is_check( argv[i] ) )
+        {
+            fprintf( stderr, "Unknown check %s\n", argv[i] );
+            return 1;
+        }
+    }
+
+    if( selected( argc, argv, "tstd" ) )
+        failed |= check_tstd( seconds ) < 0;
+    if( selected( argc, argv, "crc" ) )
+        failed |= check_crc( 200000 ) < 0;
+    if( selected( argc, argv, "edf" ) )
+        failed |= check_edf() < 0;
+
+    printf( failed ? "FAILED\n" : "all checks passed\n" );
+    return failed;
+}
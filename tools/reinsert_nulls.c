@@ -0,0 +1,98 @@
+/*****************************************************************************
+ * reinsert_nulls.c : restore the null packets of a stream muxed with null packet deletion
+ *****************************************************************************
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *****************************************************************************/
+
+/* Reads the output of ts_set_null_deletion, where each packet is preceded by the number of null packets
+ * deleted just before it, and writes the CBR transport stream. */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+
+#define TS_PACKET_SIZE 188
+#define RECORD_SIZE    (TS_PACKET_SIZE + 1)
+
+int main( int argc, char **argv )
+{
+    FILE *in = stdin, *out = stdout;
+    uint8_t record[RECORD_SIZE], null_packet[TS_PACKET_SIZE];
+    int64_t num_records = 0, num_nulls = 0;
+
+    if( argc > 3 || (argc > 1 && !strcmp( argv[1], "--help" )) )
+    {
+        fprintf( stderr, "Usage: reinsert_nulls [input [output]]\n"
+                         "Reads from stdin and writes to stdout by default\n" );
+        return 1;
+    }
+
+    if( argc > 1 && strcmp( argv[1], "-" ) && !(in = fopen( argv[1], "rb" )) )
+    {
+        fprintf( stderr, "Could not open %s\n", argv[1] );
+        return 1;
+    }
+
+    if( argc > 2 && strcmp( argv[2], "-" ) && !(out = fopen( argv[2], "wb" )) )
+    {
+        fprintf( stderr, "Could not open %s\n", argv[2] );
+        return 1;
+    }
+
+    /* the null packets written by libmpegts */
+    memset( null_packet, 0xff, TS_PACKET_SIZE );
+    null_packet[0] = 0x47;
+    null_packet[1] = 0x1f;
+    null_packet[2] = 0xff;
+    null_packet[3] = 0x10;
+
+    size_t len;
+    while( (len = fread( record, 1, RECORD_SIZE, in )) == RECORD_SIZE )
+    {
+        if( record[1] != 0x47 )
+        {
+            fprintf( stderr, "Lost sync at byte %"PRId64"\n", num_records * RECORD_SIZE );
+            return 1;
+        }
+
+        for( int i = 0; i < record[0]; i++ )
+            fwrite( null_packet, 1, TS_PACKET_SIZE, out );
+        if( fwrite( record + 1, 1, TS_PACKET_SIZE, out ) != TS_PACKET_SIZE )
+        {
+            fprintf( stderr, "Write failed\n" );
+            return 1;
+        }
+
+        num_records++;
+        num_nulls += record[0];
+    }
+
+    if( len )
+        fprintf( stderr, "Ignored %i bytes of an incomplete packet at the end\n", (int)len );
+
+    fprintf( stderr, "%"PRId64" packets, %"PRId64" null packets reinserted\n", num_records, num_nulls );
+
+    if( in != stdin )
+        fclose( in );
+    if( out != stdout && fclose( out ) )
+    {
+        fprintf( stderr, "Write failed\n" );
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,332 @@
+/*****************************************************************************
+ * udp_loopback.c : send a muxed stream through the UDP/RTP sink to localhost
+ *****************************************************************************
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *****************************************************************************/
+
+/* An example of the UDP/RTP sink which doubles as a test. A synthetic stream is muxed into ts_write_udp_sink
+ * over a loopback socket and the datagrams which arrive are checked: RTP headers, consecutive sequence
+ * numbers, timestamps which never go backwards and a payload equal to the packets the mux wrote.
+ * Halfway through the socket is disconnected until sending fails, which must not lose or repeat any packets.
+ * It also checks that the sink refuses data with another packet size. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "libmpegts.h"
+
+#define VIDEO_PID        0x100
+#define AUDIO_PID        0x101
+#define NUM_FRAMES       250
+#define FRAME_DURATION   3600
+#define AUDIO_DURATION   2160
+#define RTP_HEADER_SIZE  12
+#define RTP_PAYLOAD_MP2T 33
+
+/* the mux output goes to the sink and is kept to compare with what arrives */
+typedef struct
+{
+    ts_udp_sink_t *sink;
+    ts_memory_sink_t sent;
+} tee_t;
+
+typedef struct
+{
+    ts_memory_sink_t data;
+    int64_t num_datagrams;
+    int seq;
+    uint32_t timestamp;
+} receiver_t;
+
+static uint32_t seed = 1;
+
+static int rnd( int n )
+{
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 8) % n;
+}
+
+static int write_packets( void *opaque, uint8_t *data, int len )
+{
+    tee_t *tee = opaque;
+    int taken = ts_write_udp_sink( tee->sink, data, len );
+
+    if( taken > 0 && ts_write_memory_sink( &tee->sent, data, taken ) < taken )
+        return -1;
+
+    return taken;
+}
+
+/* Take every datagram which has arrived */
+static int receive( int fd, receiver_t *r )
+{
+    uint8_t buf[65536];
+
+    while( 1 )
+    {
+        ssize_t size = recv( fd, buf, sizeof(buf), MSG_DONTWAIT );
+        if( size < 0 )
+        {
+            if( errno == EAGAIN || errno == EWOULDBLOCK )
+                return 0;
+            if( errno == EINTR )
+                continue;
+            fprintf( stderr, "Receive failed\n" );
+            return -1;
+        }
+
+        if( size < RTP_HEADER_SIZE || (size - RTP_HEADER_SIZE) % 188 || buf[0] != 0x80 ||
+            (buf[1] & 0x7f) != RTP_PAYLOAD_MP2T )
+        {
+            fprintf( stderr, "Invalid datagram %"PRId64" of %i bytes\n", r->num_datagrams, (int)size );
+            return -1;
+        }
+
+        int seq = (buf[2] << 8) | buf[3];
+        uint32_t timestamp = ((uint32_t)buf[4] << 24) | (buf[5] << 16) | (buf[6] << 8) | buf[7];
+        if( r->num_datagrams && seq != ((r->seq + 1) & 0xffff) )
+        {
+            fprintf( stderr, "Datagram %"PRId64" has sequence number %i after %i\n", r->num_datagrams, seq, r->seq );
+            return -1;
+        }
+        if( r->num_datagrams && (int32_t)(timestamp - r->timestamp) < 0 )
+        {
+            fprintf( stderr, "Timestamp of datagram %"PRId64" goes backwards\n", r->num_datagrams );
+            return -1;
+        }
+
+        r->seq = seq;
+        r->timestamp = timestamp;
+        r->num_datagrams++;
+        if( ts_write_memory_sink( &r->data, buf + RTP_HEADER_SIZE, size - RTP_HEADER_SIZE ) < 0 )
+            return -1;
+    }
+}
+
+static int connect_socket( int rx, int tx )
+{
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+
+    if( getsockname( rx, (struct sockaddr*)&addr, &addr_len ) < 0 ||
+        connect( tx, (struct sockaddr*)&addr, sizeof(addr) ) < 0 )
+    {
+        fprintf( stderr, "Could not connect the loopback socket\n" );
+        return -1;
+    }
+
+    return 0;
+}
+
+static int open_sockets( int *rx, int *tx )
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl( INADDR_LOOPBACK ) };
+    int rcvbuf = 4 << 20;
+
+    *rx = socket( AF_INET, SOCK_DGRAM, 0 );
+    *tx = socket( AF_INET, SOCK_DGRAM, 0 );
+    if( *rx < 0 || *tx < 0 ||
+        setsockopt( *rx, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf) ) < 0 ||
+        bind( *rx, (struct sockaddr*)&addr, sizeof(addr) ) < 0 ||
+        connect_socket( *rx, *tx ) < 0 )
+    {
+        fprintf( stderr, "Could not open a loopback socket\n" );
+        return -1;
+    }
+
+    return 0;
+}
+
+static int setup_writer( ts_writer_t *w, tee_t *tee )
+{
+    ts_stream_t streams[2];
+
+    memset( streams, 0, sizeof(streams) );
+    streams[0].pid = VIDEO_PID;
+    streams[0].stream_format = LIBMPEGTS_VIDEO_AVC;
+    streams[0].stream_id = LIBMPEGTS_STREAM_ID_MPEGVIDEO;
+    streams[0].max_frame_size = 36000;
+    streams[1].pid = AUDIO_PID;
+    streams[1].stream_format = LIBMPEGTS_AUDIO_MPEG2;
+    streams[1].stream_id = LIBMPEGTS_STREAM_ID_MPEGAUDIO;
+    streams[1].max_frame_size = AUDIO_DURATION;
+
+    ts_program_t program = { .pmt_pid = 0x42, .program_num = 1, .pcr_pid = VIDEO_PID, .num_streams = 2,
+                             .streams = streams };
+    ts_main_t params = { .num_programs = 1, .programs = &program, .ts_id = 1, .muxrate = 4000000, .cbr = 1,
+                         .ts_type = TS_TYPE_DVB };
+
+    if( ts_setup_transport_stream( w, &params ) < 0 ||
+        ts_setup_mpegvideo_stream( w, VIDEO_PID, 40, AVC_HIGH, 2500000, 1000000, 0 ) < 0 ||
+        ts_set_output_callback( w, write_packets, tee, 10 ) < 0 )
+        return -1;
+
+    return 0;
+}
+
+/* Blu-ray packets and null packet deletion records can add up to whole 188 byte packets */
+static int check_framing( int fd )
+{
+    ts_udp_sink_params_t params = { .fd = fd };
+    ts_udp_sink_t *sink = ts_create_udp_sink( &params );
+    static uint8_t data[188 * 189];
+    int ret = 0;
+
+    if( !sink )
+        return -1;
+
+    /* 47 packets of 192 bytes are 48 of 188 */
+    memset( data, 0xff, sizeof(data) );
+    for( int i = 0; i < 47; i++ )
+        data[i * 192 + 4] = 0x47;
+    if( ts_write_udp_sink( sink, data, 47 * 192 ) >= 0 )
+        ret = -1;
+
+    /* 188 packets of 189 bytes are 189 of 188 */
+    memset( data, 0xff, sizeof(data) );
+    for( int i = 0; i < 188; i++ )
+    {
+        data[i * 189] = 0;
+        data[i * 189 + 1] = 0x47;
+    }
+    if( ts_write_udp_sink( sink, data, 188 * 189 ) >= 0 )
+        ret = -1;
+
+    if( ret < 0 )
+        fprintf( stderr, "UDP sink took packets of the wrong size\n" );
+
+    ts_close_udp_sink( sink );
+    return ret;
+}
+
+int main( int argc, char **argv )
+{
+    tee_t tee = { 0 };
+    receiver_t r = { { 0 } };
+    ts_frame_t frames[8];
+    uint8_t *data = malloc( 36000 );
+    ts_writer_t *w = ts_create_writer();
+    int rx = -1, tx = -1, ret = 1;
+    int64_t audio_dts = 90000;
+    int disconnected = 0, num_failures = 0;
+
+    if( !data || !w )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        goto end;
+    }
+
+    for( int i = 0; i < 36000; i++ )
+        data[i] = rnd( 256 );
+
+    if( open_sockets( &rx, &tx ) < 0 )
+        goto end;
+
+    ts_udp_sink_params_t params = { .fd = tx, .rtp = 1, .rtp_ssrc = 0x12345678 };
+    if( !(tee.sink = ts_create_udp_sink( &params )) || setup_writer( w, &tee ) < 0 )
+        goto end;
+
+    for( int f = 0; f < NUM_FRAMES; f++ )
+    {
+        int64_t dts = 90000 + f * (int64_t)FRAME_DURATION;
+        int n = 0;
+
+        memset( frames, 0, sizeof(frames) );
+        frames[n].pid = VIDEO_PID;
+        frames[n].data = data;
+        frames[n].random_access = !(f % 25);
+        frames[n].size = frames[n].random_access ? 30000 : 3000 + rnd( 8000 );
+        frames[n].dts = dts;
+        frames[n].pts = dts + 2 * FRAME_DURATION;
+        n++;
+
+        for( ; audio_dts <= dts; audio_dts += AUDIO_DURATION, n++ )
+        {
+            frames[n].pid = AUDIO_PID;
+            frames[n].data = data;
+            frames[n].size = 576;
+            frames[n].dts = frames[n].pts = audio_dts;
+        }
+
+        /* without flushing, the batch fills up and fails to go out during ts_write_frames */
+        struct sockaddr addr = { .sa_family = AF_UNSPEC };
+        if( f == NUM_FRAMES / 2 && connect( tx, &addr, sizeof(addr) ) < 0 )
+            goto end;
+        disconnected |= f == NUM_FRAMES / 2;
+
+        uint8_t *out;
+        int len;
+        int write_ret = ts_write_frames( w, frames, n, &out, &len );
+        if( write_ret < 0 && disconnected )
+        {
+            /* pass the rest of the output again */
+            if( connect_socket( rx, tx ) < 0 )
+                goto end;
+            disconnected = 0;
+            num_failures++;
+            write_ret = ts_write_frames( w, NULL, 0, &out, &len );
+        }
+
+        if( write_ret < 0 || (!disconnected && ts_flush_udp_sink( tee.sink ) < 0) || receive( rx, &r ) < 0 )
+            goto end;
+    }
+
+    if( !num_failures )
+    {
+        fprintf( stderr, "Sending did not fail on the disconnected socket\n" );
+        goto end;
+    }
+
+    int close_ret = ts_close_udp_sink( tee.sink );
+    tee.sink = NULL;
+    if( close_ret < 0 || receive( rx, &r ) < 0 )
+        goto end;
+
+    if( r.data.len != tee.sent.len || memcmp( r.data.data, tee.sent.data, r.data.len ) )
+    {
+        fprintf( stderr, "Received %i bytes which differ from the %i bytes sent\n", r.data.len, tee.sent.len );
+        goto end;
+    }
+
+    if( check_framing( tx ) < 0 )
+        goto end;
+
+    printf( "udp loopback: %"PRId64" datagrams, %i bytes ok\n", r.num_datagrams, r.data.len );
+    ret = 0;
+
+end:
+    if( tee.sink )
+        ts_close_udp_sink( tee.sink );
+    if( w )
+        ts_close_writer( w );
+    if( rx >= 0 )
+        close( rx );
+    if( tx >= 0 )
+        close( tx );
+    free( tee.sent.data );
+    free( r.data.data );
+    free( data );
+
+    return ret;
+}
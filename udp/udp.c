@@ -0,0 +1,352 @@
+/*****************************************************************************
+ * udp.c : UDP/RTP output sink
+ *****************************************************************************
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *****************************************************************************/
+
+/* sendmmsg */
+#define _GNU_SOURCE
+
+#include "../common.h"
+
+#if HAVE_SOCKET
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#define RTP_HEADER_SIZE 12
+#define RTP_PAYLOAD_MP2T 33
+#define PCR_WRAP (300LL << 33)
+
+struct ts_udp_sink_t
+{
+    ts_udp_sink_params_t params;
+    int header_size;
+    int datagram_size; /* maximum size including the RTP header */
+
+    /* datagrams of the current batch, the last one may be incomplete */
+    uint8_t *buf;
+    int *sizes;
+    int64_t *pcrs;
+    int num_datagrams;
+    int64_t seq;
+
+#if HAVE_SENDMMSG
+    struct mmsghdr *msgs;
+#endif
+    struct iovec *iov;
+
+    /* the last two PCRs and the stream position of their packets */
+    int64_t pos;
+    int num_pcrs;
+    int64_t pcr[2];
+    int64_t pcr_pos[2];
+};
+
+static void parse_pcr( ts_udp_sink_t *sink, uint8_t *pkt )
+{
+    int pid = ((pkt[1] & 0x1f) << 8) | pkt[2];
+
+    if( pkt[0] != 0x47 || !(pkt[3] & 0x20) || !pkt[4] || !(pkt[5] & 0x10) )
+        return;
+
+    /* the first PCR PID seen unless one is given */
+    if( !sink->params.pcr_pid )
+        sink->params.pcr_pid = pid;
+    else if( pid != sink->params.pcr_pid )
+        return;
+
+    int64_t base = ((int64_t)pkt[6] << 25) | (pkt[7] << 17) | (pkt[8] << 9) | (pkt[9] << 1) | (pkt[10] >> 7);
+    int ext = ((pkt[10] & 1) << 8) | pkt[11];
+
+    sink->pcr[0] = sink->pcr[1];
+    sink->pcr_pos[0] = sink->pcr_pos[1];
+    sink->pcr[1] = base * 300 + ext;
+    sink->pcr_pos[1] = sink->pos;
+    sink->num_pcrs++;
+}
+
+/* Time of the packet at pos, interpolated from the last two PCRs. -1 before the first PCR */
+static int64_t packet_time( ts_udp_sink_t *sink, int64_t pos )
+{
+    if( !sink->num_pcrs )
+        return -1;
+    if( sink->num_pcrs == 1 || sink->pcr_pos[1] == sink->pcr_pos[0] )
+        return sink->pcr[1];
+
+    int64_t delta = sink->pcr[1] - sink->pcr[0];
+    if( delta < 0 )
+        delta += PCR_WRAP;
+
+    int64_t pcr = sink->pcr[1] + (pos - sink->pcr_pos[1]) * delta / (sink->pcr_pos[1] - sink->pcr_pos[0]);
+    return (pcr % PCR_WRAP + PCR_WRAP) % PCR_WRAP;
+}
+
+static void write_rtp_header( ts_udp_sink_t *sink, uint8_t *p, int64_t seq, int64_t pcr )
+{
+    uint32_t timestamp = pcr < 0 ? 0 : (uint32_t)(pcr / 300);
+
+    p[0] = 0x80; // version 2
+    p[1] = RTP_PAYLOAD_MP2T;
+    p[2] = seq >> 8;
+    p[3] = seq;
+    p[4] = timestamp >> 24;
+    p[5] = timestamp >> 16;
+    p[6] = timestamp >> 8;
+    p[7] = timestamp;
+    p[8] = sink->params.rtp_ssrc >> 24;
+    p[9] = sink->params.rtp_ssrc >> 16;
+    p[10] = sink->params.rtp_ssrc >> 8;
+    p[11] = sink->params.rtp_ssrc;
+}
+
+/* Move on past the first num datagrams, which were sent */
+static void drop_datagrams( ts_udp_sink_t *sink, int num )
+{
+    sink->seq += num;
+    sink->num_datagrams -= num;
+
+    /* keep the datagrams which were not sent, and the incomplete one */
+    if( num && sink->num_datagrams )
+    {
+        memmove( sink->buf, sink->buf + num * sink->datagram_size, sink->num_datagrams * sink->datagram_size );
+        memmove( sink->sizes, sink->sizes + num, sink->num_datagrams * sizeof(*sink->sizes) );
+        memmove( sink->pcrs, sink->pcrs + num, sink->num_datagrams * sizeof(*sink->pcrs) );
+    }
+}
+
+/* Send the first num datagrams of the batch, several per system call if possible.
+ * On failure the datagrams which did go out are dropped too, so they are not sent again */
+static int send_datagrams( ts_udp_sink_t *sink, int num )
+{
+    int sent = 0;
+
+    for( int i = 0; i < num; i++ )
+    {
+        uint8_t *p = sink->buf + i * sink->datagram_size;
+        if( sink->params.rtp )
+            write_rtp_header( sink, p, sink->seq + i, sink->pcrs[i] );
+        sink->iov[i].iov_base = p;
+        sink->iov[i].iov_len = sink->sizes[i];
+    }
+
+    while( sent < num )
+    {
+#if HAVE_SENDMMSG
+        for( int i = sent; i < num; i++ )
+        {
+            memset( &sink->msgs[i], 0, sizeof(sink->msgs[i]) );
+            sink->msgs[i].msg_hdr.msg_iov = &sink->iov[i];
+            sink->msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        int ret = sendmmsg( sink->params.fd, &sink->msgs[sent], num - sent, 0 );
+#else
+        struct msghdr msg = { .msg_iov = &sink->iov[sent], .msg_iovlen = 1 };
+        int ret = sendmsg( sink->params.fd, &msg, 0 ) < 0 ? -1 : 1;
+#endif
+        if( ret < 0 )
+        {
+            if( errno == EINTR )
+                continue;
+            fprintf( stderr, "UDP send failed\n" );
+            drop_datagrams( sink, sent );
+            return -1;
+        }
+
+        if( sink->params.datagram_sent )
+        {
+            int64_t now = monotonic_time();
+            for( int i = sent; i < sent + ret; i++ )
+            {
+                ts_datagram_info_t info = { .seq = sink->seq + i, .size = sink->sizes[i], .pcr = sink->pcrs[i], .send_time = now };
+                sink->params.datagram_sent( sink->params.opaque, &info );
+            }
+        }
+        sent += ret;
+    }
+
+    drop_datagrams( sink, num );
+
+    return 0;
+}
+
+ts_udp_sink_t *ts_create_udp_sink( ts_udp_sink_params_t *params )
+{
+    ts_udp_sink_t *sink = calloc( 1, sizeof(*sink) );
+    if( !sink )
+    {
+        fprintf( stderr, "Malloc failed\n" );
+        return NULL;
+    }
+
+    sink->params = *params;
+    if( !sink->params.packets_per_datagram )
+        sink->params.packets_per_datagram = 7;
+    if( !sink->params.batch_size )
+        sink->params.batch_size = 16;
+
+    if( sink->params.packets_per_datagram < 0 || sink->params.batch_size < 0 )
+    {
+        fprintf( stderr, "Invalid UDP sink parameters\n" );
+        free( sink );
+        return NULL;
+    }
+
+    sink->header_size = sink->params.rtp ? RTP_HEADER_SIZE : 0;
+    sink->datagram_size = sink->header_size + sink->params.packets_per_datagram * TS_PACKET_SIZE;
+
+    int num = sink->params.batch_size;
+    sink->buf = malloc( num * sink->datagram_size );
+    sink->sizes = calloc( num, sizeof(*sink->sizes) );
+    sink->pcrs = calloc( num, sizeof(*sink->pcrs) );
+    sink->iov = calloc( num, sizeof(*sink->iov) );
+#if HAVE_SENDMMSG
+    sink->msgs = calloc( num, sizeof(*sink->msgs) );
+    if( !sink->msgs )
+        goto fail;
+#endif
+    if( !sink->buf || !sink->sizes || !sink->pcrs || !sink->iov )
+        goto fail;
+
+    return sink;
+
+fail:
+    fprintf( stderr, "Malloc failed\n" );
+    ts_close_udp_sink( sink );
+    return NULL;
+}
+
+int ts_write_udp_sink( void *opaque, uint8_t *data, int len )
+{
+    ts_udp_sink_t *sink = opaque;
+
+    /* other framings, e.g. Blu-ray or null packet deletion, can add up to a multiple of 188 bytes */
+    for( int i = 0; i < len; i += TS_PACKET_SIZE )
+    {
+        if( len - i < TS_PACKET_SIZE || data[i] != 0x47 )
+        {
+            fprintf( stderr, "UDP sink needs %i byte packets\n", TS_PACKET_SIZE );
+            return -1;
+        }
+    }
+
+    int num_pcrs = sink->num_pcrs;
+    int64_t pcr[2], pcr_pos[2];
+
+    for( int i = 0; i < len; i += TS_PACKET_SIZE )
+    {
+        /* start a new datagram */
+        if( !sink->num_datagrams || sink->sizes[sink->num_datagrams-1] == sink->datagram_size )
+        {
+            /* the packets before this one were taken */
+            if( sink->num_datagrams == sink->params.batch_size && send_datagrams( sink, sink->num_datagrams ) < 0 )
+                return i;
+            sink->sizes[sink->num_datagrams] = sink->header_size;
+            sink->pcrs[sink->num_datagrams] = -1;
+            sink->num_datagrams++;
+        }
+
+        int cur = sink->num_datagrams - 1;
+        uint8_t *p = sink->buf + cur * sink->datagram_size + sink->sizes[cur];
+        memcpy( p, data + i, TS_PACKET_SIZE );
+        num_pcrs = sink->num_pcrs;
+        memcpy( pcr, sink->pcr, sizeof(pcr) );
+        memcpy( pcr_pos, sink->pcr_pos, sizeof(pcr_pos) );
+        parse_pcr( sink, p );
+
+        /* timestamp of the first packet, known once the datagram is complete */
+        sink->sizes[cur] += TS_PACKET_SIZE;
+        sink->pos += TS_PACKET_SIZE;
+        if( sink->sizes[cur] == sink->datagram_size )
+            sink->pcrs[cur] = packet_time( sink, sink->pos - (sink->datagram_size - sink->header_size) );
+    }
+
+    /* send a full batch straight away. If that fails the last datagram is still here, so its last packet is
+     * given back to be passed again */
+    if( sink->num_datagrams == sink->params.batch_size && sink->sizes[sink->num_datagrams-1] == sink->datagram_size &&
+        send_datagrams( sink, sink->num_datagrams ) < 0 )
+    {
+        int cur = sink->num_datagrams - 1;
+        sink->sizes[cur] -= TS_PACKET_SIZE;
+        sink->pcrs[cur] = -1;
+        sink->pos -= TS_PACKET_SIZE;
+        sink->num_pcrs = num_pcrs;
+        memcpy( sink->pcr, pcr, sizeof(pcr) );
+        memcpy( sink->pcr_pos, pcr_pos, sizeof(pcr_pos) );
+        return len - TS_PACKET_SIZE;
+    }
+
+    return len;
+}
+
+int ts_flush_udp_sink( ts_udp_sink_t *sink )
+{
+    int num = sink->num_datagrams;
+    if( num && sink->sizes[num-1] != sink->datagram_size )
+        num--;
+
+    return num ? send_datagrams( sink, num ) : 0;
+}
+
+int ts_close_udp_sink( ts_udp_sink_t *sink )
+{
+    int ret = 0;
+
+    /* send the incomplete datagram too */
+    if( sink->buf && sink->num_datagrams )
+    {
+        int cur = sink->num_datagrams - 1;
+        if( sink->pcrs[cur] < 0 )
+            sink->pcrs[cur] = packet_time( sink, sink->pos - (sink->sizes[cur] - sink->header_size) );
+        ret = send_datagrams( sink, sink->num_datagrams );
+    }
+
+    free( sink->buf );
+    free( sink->sizes );
+    free( sink->pcrs );
+    free( sink->iov );
+#if HAVE_SENDMMSG
+    free( sink->msgs );
+#endif
+    free( sink );
+
+    return ret;
+}
+
+#else
+
+ts_udp_sink_t *ts_create_udp_sink( ts_udp_sink_params_t *params )
+{
+    fprintf( stderr, "libmpegts was built without UDP support\n" );
+    return NULL;
+}
+
+int ts_write_udp_sink( void *opaque, uint8_t *data, int len )
+{
+    return -1;
+}
+
+int ts_flush_udp_sink( ts_udp_sink_t *sink )
+{
+    return -1;
+}
+
+int ts_close_udp_sink( ts_udp_sink_t *sink )
+{
+    return -1;
+}
+
+#endif